@@ -1,4 +1,5 @@
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <time.h>
@@ -6,11 +7,18 @@
 #include <pthread.h>
 #include <sched.h>
 #include <string.h>
+#include <assert.h>
 #include "sr_arpcache.h"
 #include "sr_router.h"
 #include "sr_if.h"
 #include "sr_protocol.h"
 
+static void sr_arpreq_schedule(struct sr_arpcache *cache, struct sr_arpreq *req,
+                               time_t when);
+static void sr_arpcache_store(struct sr_arpcache *cache, uint32_t ip,
+                              const unsigned char *mac, int ifindex, int valid,
+                              time_t added);
+
 /* 
   This function gets called every second. For each request sent out, we keep
   checking whether we should resend an request or destroy the arp request.
@@ -26,8 +34,8 @@ void handle_arpreq(struct sr_instance *sr, struct sr_arpreq *req){
     printf("ip of req that needs sending %lu\n", ntohl(req->ip));
     req->times_sent++;
     req->sent = time(NULL);
-    printf("outgoing interface of arp %s times sent %d\n", req->packets->iface, req->times_sent);
-    send_arprequest(sr, req->ip, req->packets->iface);
+    printf("outgoing interface of arp %d times sent %d\n", req->packets->ifindex, req->times_sent);
+    send_arprequest(sr, req->ip, req->packets->ifindex);
 
 }
 
@@ -36,17 +44,32 @@ void sr_arpcache_sweepreqs(struct sr_instance *sr) {
     struct sr_if* iface = 0;
     struct sr_arpcache *cache = &(sr->cache);
     char outgoing_iface[sr_IFACE_NAMELEN];
-    time_t curtime = time(NULL);
-    struct sr_arpreq *req;
-    for (req = sr->cache.requests; req != NULL; req = req->next) {
-        if ((req->times_sent < 5) && (difftime(curtime,req->sent) > 1.0)){
+    struct sr_arpreq *req, *next_req;
+    /* only the requests due on this turn of the wheel, see sr_arpcache_timeout() */
+    req = cache->wheel[cache->wheel_now & (SR_ARPCACHE_WHEEL - 1)].reqs;
+    for (; req != NULL; req = next_req) {
+        next_req = req->tnext;
+        if (req->due > cache->wheel_now) {
+            /* due on a later turn */
+            continue;
+        }
+        if (!req->packets) {
+            /* every packet was dropped, nothing to resolve it for */
+            sr_arpreq_destroy(cache, req);
+        }
+        else if (req->times_sent < 5){
             handle_arpreq(sr, req);
+            sr_arpreq_schedule(cache, req, req->sent + 1);
         }
-        else if(req->times_sent == 5){
+        else {
 
+            /* remember it is dead, so new packets for it are refused
+               straight away instead of starting over */
+            sr_arpcache_store(cache, req->ip, NULL, req->packets->ifindex, 0, time(NULL));
+            
             struct sr_packet *pkt, *nxt;
             for (pkt = req->packets; pkt; pkt = nxt) {
-                iface = sr_get_interface(sr, pkt->iface);
+                iface = sr_get_interface_idx(sr, pkt->ifindex);
                 handle_icmp(sr, pkt->buf, pkt->len, iface, 3, 1);
                 nxt = pkt->next;
             }
@@ -60,34 +83,507 @@ void sr_arpcache_sweepreqs(struct sr_instance *sr) {
 }
 
 
+/* Hash of an IP (network byte order) whose low bits depend on all of it. */
+static unsigned int sr_arpcache_hash(uint32_t ip) {
+    unsigned int h = ntohl(ip) * 2654435761u;
+    return h ^ (h >> 16);
+}
+
+/* Bracket a change to the table for lock-free readers. Call with the lock
+   held. */
+static void sr_arpcache_write_begin(struct sr_arpcache *cache) {
+    cache->seq++;
+    __sync_synchronize();
+}
+
+static void sr_arpcache_write_end(struct sr_arpcache *cache) {
+    __sync_synchronize();
+    cache->seq++;
+}
+
+/* Returns the slot holding ip, or -1. Call with the lock held. */
+static int sr_arpcache_find(struct sr_arpcache *cache, uint32_t ip) {
+    unsigned int mask = cache->n_slots - 1;
+    unsigned int i = sr_arpcache_hash(ip) & mask;
+
+    while (cache->entries[i].ip) {
+        if (cache->entries[i].ip == ip)
+            return i;
+        i = (i + 1) & mask;
+    }
+    return -1;
+}
+
+/* Empties slot i, shifting later entries of its probe run back so lookups
+   never need tombstones. Call with the lock held. */
+static void sr_arpcache_remove_slot(struct sr_arpcache *cache, unsigned int i) {
+    unsigned int mask = cache->n_slots - 1;
+    unsigned int j = i, home;
+
+    sr_arpcache_write_begin(cache);
+    while (1) {
+        j = (j + 1) & mask;
+        if (!cache->entries[j].ip)
+            break;
+        /* entry at j may fill the hole at i unless its home lies in (i, j] */
+        home = sr_arpcache_hash(cache->entries[j].ip) & mask;
+        if (((j - home) & mask) < ((j - i) & mask))
+            continue;
+        cache->entries[i] = cache->entries[j];
+        i = j;
+    }
+    memset(&(cache->entries[i]), 0, sizeof(struct sr_arpentry));
+    cache->n_entries--;
+    sr_arpcache_write_end(cache);
+}
+
+/* Doubles the table. The new table is filled before readers can see it,
+   and published before its size so a reader never probes past the end of
+   whichever table it got. The old one is retired, not freed. Call with the
+   lock held. */
+static void sr_arpcache_grow(struct sr_arpcache *cache) {
+    struct sr_arpentry *old = cache->entries, *table;
+    unsigned int old_slots = cache->n_slots, n_slots = old_slots * 2, i, j;
+
+    if (cache->n_retired == SR_ARPCACHE_MAX_RETIRED)
+        return;
+
+    table = (struct sr_arpentry *) calloc(n_slots, sizeof(struct sr_arpentry));
+    assert(table);
+    for (i = 0; i < old_slots; i++) {
+        if (!old[i].ip)
+            continue;
+        j = sr_arpcache_hash(old[i].ip) & (n_slots - 1);
+        while (table[j].ip)
+            j = (j + 1) & (n_slots - 1);
+        table[j] = old[i];
+    }
+
+    sr_arpcache_write_begin(cache);
+    cache->entries = table;
+    __sync_synchronize();
+    cache->n_slots = n_slots;
+    sr_arpcache_write_end(cache);
+
+    cache->retired[cache->n_retired++] = old;
+}
+
+/* Makes room for ip in a full cache by evicting the oldest entry among the
+   SR_ARPCACHE_EVICT_SCAN slots from ip's home slot on. With negative set
+   only negative entries in those slots are candidates, so remembering a
+   host that did not answer never pushes out a working mapping. Returns 0,
+   or -1 if nothing could be evicted. Call with the lock held. */
+static int sr_arpcache_evict(struct sr_arpcache *cache, uint32_t ip, int negative) {
+    unsigned int mask = cache->n_slots - 1;
+    unsigned int i = sr_arpcache_hash(ip) & mask;
+    int k, victim = -1;
+
+    for (k = 0; k < SR_ARPCACHE_EVICT_SCAN; k++, i = (i + 1) & mask) {
+        if (cache->entries[i].ip && (!negative || !cache->entries[i].valid) &&
+            (victim < 0 || cache->entries[i].added < cache->entries[victim].added))
+            victim = i;
+    }
+    if (victim < 0 && negative)
+        return -1;
+    /* a full cache is at most half empty, so some slot nearby is in use */
+    for (; victim < 0; i = (i + 1) & mask) {
+        if (cache->entries[i].ip)
+            victim = i;
+    }
+    sr_arpcache_remove_slot(cache, victim);
+    cache->evictions++;
+    return 0;
+}
+
+/* Sets a timer for ip's entry of generation gen to be looked at in second
+   when, or on the next turn of the wheel if that has passed. Returns 0, or
+   -1 if out of memory. Call with the lock held. */
+static int sr_arpcache_set_timer(struct sr_arpcache *cache, uint32_t ip,
+                                 uint32_t gen, time_t when) {
+    struct sr_arpwheel_slot *slot;
+
+    if (when <= cache->wheel_now)
+        when = cache->wheel_now + 1;
+    slot = &(cache->wheel[when & (SR_ARPCACHE_WHEEL - 1)]);
+
+    if (slot->n_timers == slot->cap_timers) {
+        unsigned int cap = slot->cap_timers ? slot->cap_timers * 2 : 16;
+        struct sr_arptimer *timers = (struct sr_arptimer *) realloc(slot->timers, cap * sizeof(struct sr_arptimer));
+        if (!timers)
+            return -1;
+        slot->timers = timers;
+        slot->cap_timers = cap;
+    }
+    slot->timers[slot->n_timers].ip = ip;
+    slot->timers[slot->n_timers].gen = gen;
+    slot->timers[slot->n_timers].when = when;
+    slot->n_timers++;
+    return 0;
+}
+
+/* Runs the entry timers in the current wheel slot. From SR_ARPCACHE_REFRESH
+   seconds before an entry expires, every second it has been used in gets
+   a unicast ARP request to its owner. Past SR_ARPCACHE_TO it is removed
+   the first second nobody uses it, or once SR_ARPCACHE_STALE_TO seconds
+   stale, unless a reply has refreshed it first. Negative entries go
+   SR_ARPCACHE_NEG_TO seconds after they were made. Timers whose entry is
+   gone (evicted), or was evicted and made again with a timer of its own,
+   are dropped. Call with the lock held. */
+static void sr_arpcache_expire(struct sr_instance *sr, time_t now) {
+    struct sr_arpcache *cache = &(sr->cache);
+    unsigned int cur = cache->wheel_now & (SR_ARPCACHE_WHEEL - 1);
+    struct sr_arpwheel_slot *slot = &(cache->wheel[cur]);
+    unsigned int k, keep = 0;
+
+    for (k = 0; k < slot->n_timers; k++) {
+        struct sr_arptimer t = slot->timers[k];
+        struct sr_arpentry *e;
+        double age;
+        int i;
+
+        if (t.when > now) {
+            /* due on a later turn */
+            slot->timers[keep++] = t;
+            continue;
+        }
+        i = sr_arpcache_find(cache, t.ip);
+        if (i < 0 || cache->entries[i].gen != t.gen)
+            continue;
+        e = &(cache->entries[i]);
+        age = difftime(now, e->added);
+
+        if (!e->valid) {
+            if (age >= SR_ARPCACHE_NEG_TO) {
+                sr_arpcache_remove_slot(cache, i);
+                continue;
+            }
+            t.when = e->added + (time_t) SR_ARPCACHE_NEG_TO;
+        }
+        else if (age > SR_ARPCACHE_TO + SR_ARPCACHE_STALE_TO) {
+            sr_arpcache_remove_slot(cache, i);
+            continue;
+        }
+        else if (age >= SR_ARPCACHE_TO - SR_ARPCACHE_REFRESH && e->used) {
+            e->used = 0;
+            send_arprequest_to(sr, e->ip, e->mac, e->ifindex);
+            t.when = now + 1;
+        }
+        else if (age > SR_ARPCACHE_TO) {
+            sr_arpcache_remove_slot(cache, i);
+            continue;
+        }
+        else if (age >= SR_ARPCACHE_TO - SR_ARPCACHE_REFRESH)
+            t.when = now + 1;   /* see whether it gets used before it goes */
+        else
+            t.when = e->added + (time_t) (SR_ARPCACHE_TO - SR_ARPCACHE_REFRESH);
+
+        if ((t.when & (SR_ARPCACHE_WHEEL - 1)) == cur)
+            slot->timers[keep++] = t;   /* would land back in this slot */
+        else if (sr_arpcache_set_timer(cache, t.ip, t.gen, t.when) != 0)
+            sr_arpcache_remove_slot(cache, i);  /* cannot time it out later */
+    }
+    slot->n_timers = keep;
+}
+
+/* Takes req off the wheel slot it is due in, if any. Call with the lock
+   held. */
+static void sr_arpreq_unschedule(struct sr_arpcache *cache, struct sr_arpreq *req) {
+    struct sr_arpwheel_slot *slot = &(cache->wheel[req->due & (SR_ARPCACHE_WHEEL - 1)]);
+
+    if (req->tprev)
+        req->tprev->tnext = req->tnext;
+    else if (slot->reqs == req)
+        slot->reqs = req->tnext;
+    else
+        return;
+    if (req->tnext)
+        req->tnext->tprev = req->tprev;
+    req->tnext = req->tprev = NULL;
+}
+
+/* Makes req due in second when, or on the next turn of the wheel if that
+   has passed. Call with the lock held. */
+static void sr_arpreq_schedule(struct sr_arpcache *cache, struct sr_arpreq *req,
+                               time_t when) {
+    struct sr_arpwheel_slot *slot;
+
+    sr_arpreq_unschedule(cache, req);
+    if (when <= cache->wheel_now)
+        when = cache->wheel_now + 1;
+    slot = &(cache->wheel[when & (SR_ARPCACHE_WHEEL - 1)]);
+
+    req->due = when;
+    req->tprev = NULL;
+    req->tnext = slot->reqs;
+    if (slot->reqs)
+        slot->reqs->tprev = req;
+    slot->reqs = req;
+}
+
+/* Sets up an empty pool of objects of at least size bytes. */
+static void sr_arppool_init(struct sr_arppool *pool, unsigned int size) {
+    memset(pool, 0, sizeof(*pool));
+    pool->size = (size + SR_ARPPOOL_ALIGN - 1) & ~(SR_ARPPOOL_ALIGN - 1);
+}
+
+/* Returns a free object from pool, carving a new slab if there is none,
+   or NULL if out of memory. Call with the lock held. */
+static void *sr_arppool_get(struct sr_arppool *pool) {
+    void *obj;
+
+    if (!pool->free) {
+        /* the slab's first SR_ARPPOOL_ALIGN bytes link it to the others */
+        char *slab = (char *) malloc(SR_ARPPOOL_SLAB);
+        unsigned int off;
+        if (!slab)
+            return NULL;
+        *(void **) slab = pool->slabs;
+        pool->slabs = slab;
+        pool->n_slabs++;
+        for (off = SR_ARPPOOL_ALIGN; off + pool->size <= SR_ARPPOOL_SLAB; off += pool->size) {
+            *(void **) (slab + off) = pool->free;
+            pool->free = slab + off;
+            pool->n_free++;
+        }
+    }
+
+    obj = pool->free;
+    pool->free = *(void **) obj;
+    pool->n_free--;
+    pool->in_use++;
+    return obj;
+}
+
+/* Puts obj, which came from pool, back on its free list. Call with the
+   lock held. */
+static void sr_arppool_put(struct sr_arppool *pool, void *obj) {
+    *(void **) obj = pool->free;
+    pool->free = obj;
+    pool->n_free++;
+    pool->in_use--;
+}
+
+/* Frees every slab of pool. */
+static void sr_arppool_destroy(struct sr_arppool *pool) {
+    while (pool->slabs) {
+        void *next = *(void **) pool->slabs;
+        free(pool->slabs);
+        pool->slabs = next;
+    }
+    pool->free = NULL;
+    pool->n_slabs = pool->in_use = pool->n_free = 0;
+}
+
+/* Returns a packet with room for len bytes of frame after it, from the
+   smallest class it fits, or NULL if out of memory. Call with the lock
+   held. */
+static struct sr_packet *sr_arppool_get_packet(struct sr_arpcache *cache, unsigned int len) {
+    struct sr_packet *pkt;
+    int c;
+
+    for (c = 0; c < SR_ARPPOOL_CLASSES; c++) {
+        if (sizeof(struct sr_packet) + len <= cache->pkt_pools[c].size)
+            break;
+    }
+    if (c < SR_ARPPOOL_CLASSES) {
+        pkt = (struct sr_packet *) sr_arppool_get(&(cache->pkt_pools[c]));
+    }
+    else {
+        pkt = (struct sr_packet *) malloc(sizeof(struct sr_packet) + len);
+        c = -1;
+        if (pkt)
+            cache->pkt_mallocs++;
+    }
+    if (pkt)
+        pkt->pool = c;
+    return pkt;
+}
+
+/* Returns the queued request for ip, or NULL. Call with the lock held. */
+static struct sr_arpreq *sr_arpreq_find(struct sr_arpcache *cache, uint32_t ip) {
+    struct sr_arpreq *req = cache->req_buckets[sr_arpcache_hash(ip) & (cache->n_req_buckets - 1)];
+    while (req && req->ip != ip)
+        req = req->hnext;
+    return req;
+}
+
+/* Doubles the request table once it averages more than one request per
+   bucket. Call with the lock held. */
+static void sr_arpreq_grow(struct sr_arpcache *cache) {
+    unsigned int n = cache->n_req_buckets * 2;
+    struct sr_arpreq **buckets = (struct sr_arpreq **) calloc(n, sizeof(struct sr_arpreq *));
+    struct sr_arpreq *req;
+
+    /* keep the smaller table if memory is short, chains just get longer */
+    if (!buckets)
+        return;
+    for (req = cache->requests; req; req = req->next) {
+        unsigned int b = sr_arpcache_hash(req->ip) & (n - 1);
+        req->hnext = buckets[b];
+        buckets[b] = req;
+    }
+    free(cache->req_buckets);
+    cache->req_buckets = buckets;
+    cache->n_req_buckets = n;
+}
+
+/* Puts req at the head of the request queue and into the request table.
+   Call with the lock held. */
+static void sr_arpreq_link(struct sr_arpcache *cache, struct sr_arpreq *req) {
+    unsigned int b;
+
+    /* grow first, the rehash walks the queue and must not see req yet */
+    if (++cache->n_requests > cache->n_req_buckets)
+        sr_arpreq_grow(cache);
+
+    req->prev = NULL;
+    req->next = cache->requests;
+    if (req->next)
+        req->next->prev = req;
+    cache->requests = req;
+
+    b = sr_arpcache_hash(req->ip) & (cache->n_req_buckets - 1);
+    req->hnext = cache->req_buckets[b];
+    cache->req_buckets[b] = req;
+}
+
+/* Takes req off the request queue, out of the request table and off the
+   timer wheel. Call with the lock held. */
+static void sr_arpreq_unlink(struct sr_arpcache *cache, struct sr_arpreq *req) {
+    struct sr_arpreq **pp = &(cache->req_buckets[sr_arpcache_hash(req->ip) & (cache->n_req_buckets - 1)]);
+
+    sr_arpreq_unschedule(cache, req);
+
+    while (*pp != req)
+        pp = &((*pp)->hnext);
+    *pp = req->hnext;
+
+    if (req->prev)
+        req->prev->next = req->next;
+    else
+        cache->requests = req->next;
+    if (req->next)
+        req->next->prev = req->prev;
+
+    req->next = req->prev = req->hnext = NULL;
+    cache->n_requests--;
+}
+
+/* Frees pkt, one of req's packets, and takes it out of the queue
+   counters. The caller unlinks it. Call with the lock held. */
+static void sr_arpreq_free_packet(struct sr_arpcache *cache, struct sr_arpreq *req,
+                                  struct sr_packet *pkt) {
+    req->n_packets--;
+    req->n_bytes -= pkt->len;
+    cache->n_queued--;
+    cache->n_queued_bytes -= pkt->len;
+    if (pkt->pool >= 0)
+        sr_arppool_put(&(cache->pkt_pools[pkt->pool]), pkt);
+    else
+        free(pkt);
+}
+
+/* Drops the packet that has waited longest on req, which must have one.
+   Call with the lock held. */
+static void sr_arpreq_drop_oldest(struct sr_arpcache *cache, struct sr_arpreq *req) {
+    struct sr_packet *pkt = req->packets;
+    req->packets = pkt->next;
+    if (!req->packets)
+        req->packets_tail = NULL;
+    sr_arpreq_free_packet(cache, req, pkt);
+    cache->oldest_drops++;
+}
+
+/* Returns 1 if a packet of len bytes may be queued on req, after dropping
+   req's oldest packets if the policy allows it, or 0 if it has to be
+   dropped. Only req's own packets are ever pushed out, so nothing is
+   dropped unless that makes enough room. Call with the lock held. */
+static int sr_arpreq_make_room(struct sr_arpcache *cache, struct sr_arpreq *req,
+                               unsigned int len) {
+    struct sr_arpq_limits *lim = &(cache->limits);
+
+    if (len > lim->req_bytes || len > lim->max_bytes)
+        return 0;
+    if (lim->policy != SR_ARPQ_DROP_OLDEST ||
+        cache->n_queued - req->n_packets + 1 > lim->max_packets ||
+        cache->n_queued_bytes - req->n_bytes + len > lim->max_bytes) {
+        return req->n_packets + 1 <= lim->req_packets &&
+               req->n_bytes + len <= lim->req_bytes &&
+               cache->n_queued + 1 <= lim->max_packets &&
+               cache->n_queued_bytes + len <= lim->max_bytes;
+    }
+
+    while (req->n_packets + 1 > lim->req_packets ||
+           req->n_bytes + len > lim->req_bytes ||
+           cache->n_queued + 1 > lim->max_packets ||
+           cache->n_queued_bytes + len > lim->max_bytes)
+        sr_arpreq_drop_oldest(cache, req);
+    return 1;
+}
+
 /* You should not need to touch the rest of this code. */
 
 /* Checks if an IP->MAC mapping is in the cache. IP is in network byte order.
    You must free the returned structure if it is not NULL. */
 struct sr_arpentry *sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip) {
-    pthread_mutex_lock(&(cache->lock));
-    
-    struct sr_arpentry *entry = NULL, *copy = NULL;
-    
-    int i;
-    for (i = 0; i < SR_ARPCACHE_SZ; i++) {
-        if ((cache->entries[i].valid) && (cache->entries[i].ip == ip)) {
-            entry = &(cache->entries[i]);
-        }
-    }
+    struct sr_arpentry entry, *copy = NULL;
     
     /* Must return a copy b/c another thread could jump in and modify
        table after we return. */
-    if (entry) {
+    if (sr_arpcache_lookup_mac(cache, ip, &entry) && entry.valid) {
         copy = (struct sr_arpentry *) malloc(sizeof(struct sr_arpentry));
-        memcpy(copy, entry, sizeof(struct sr_arpentry));
+        memcpy(copy, &entry, sizeof(struct sr_arpentry));
     }
-        
-    pthread_mutex_unlock(&(cache->lock));
     
     return copy;
 }
 
+/* Copies the entry for IP into *entry and returns 1, or returns 0 if there
+   is none. Reads the table without the lock: the probe is redone if a
+   writer was active or the sequence number moved under it. */
+int sr_arpcache_lookup_mac(struct sr_arpcache *cache, uint32_t ip,
+                           struct sr_arpentry *entry) {
+    struct sr_arpentry *table;
+    unsigned int seq, mask, i, probes;
+    int found = 0;
+    
+    if (!ip)
+        return 0;
+    
+    do {
+        seq = cache->seq;
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        __sync_synchronize();
+        
+        /* size first: a table is never smaller than the size read before it */
+        mask = cache->n_slots - 1;
+        __sync_synchronize();
+        table = cache->entries;
+        
+        found = 0;
+        i = sr_arpcache_hash(ip) & mask;
+        for (probes = 0; probes <= mask && table[i].ip; probes++) {
+            if (table[i].ip == ip) {
+                *entry = table[i];
+                found = 1;
+                break;
+            }
+            i = (i + 1) & mask;
+        }
+        __sync_synchronize();
+    } while ((seq & 1) || cache->seq != seq);
+    
+    /* tell the timeout thread it is worth refreshing. The slot may hold
+       another entry by now, which at worst costs one needless probe. */
+    if (found && entry->valid && !entry->used)
+        table[i].used = 1;
+    
+    return found;
+}
+
 /* Adds an ARP request to the ARP request queue. If the request is already on
    the queue, adds the packet to the linked list of packets for this sr_arpreq
    that corresponds to this ARP request. You should free the passed *packet.
@@ -98,36 +594,52 @@ struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
                                        uint32_t ip,
                                        uint8_t *packet,           /* borrowed */
                                        unsigned int packet_len,
-                                       char *iface)
+                                       int ifindex)
 {
     pthread_mutex_lock(&(cache->lock));
     
-    struct sr_arpreq *req;
-    for (req = cache->requests; req != NULL; req = req->next) {
-        if (req->ip == ip) {
-            break;
-        }
-    }
+    struct sr_arpreq *req = sr_arpreq_find(cache, ip);
     
     /* If the IP wasn't found, add it */
     if (!req) {
-        req = (struct sr_arpreq *) calloc(1, sizeof(struct sr_arpreq));
+        req = (struct sr_arpreq *) sr_arppool_get(&(cache->req_pool));
+        if (!req) {
+            pthread_mutex_unlock(&(cache->lock));
+            return NULL;
+        }
+        memset(req, 0, sizeof(struct sr_arpreq));
         req->ip = ip;
-        req->next = cache->requests;
-        cache->requests = req;
+        sr_arpreq_link(cache, req);
+        sr_arpreq_schedule(cache, req, cache->wheel_now + 1);
     }
     
     /* Add the packet to the list of packets for this request */
-    if (packet && packet_len && iface) {
-        struct sr_packet *new_pkt = (struct sr_packet *)malloc(sizeof(struct sr_packet));
+    if (packet && packet_len && ifindex != SR_IF_NONE) {
+        struct sr_packet *new_pkt = NULL;
         
-        new_pkt->buf = (uint8_t *)malloc(packet_len);
-        memcpy(new_pkt->buf, packet, packet_len);
-        new_pkt->len = packet_len;
-		new_pkt->iface = (char *)malloc(sr_IFACE_NAMELEN);
-        strncpy(new_pkt->iface, iface, sr_IFACE_NAMELEN);
-        new_pkt->next = req->packets;
-        req->packets = new_pkt;
+        if (sr_arpreq_make_room(cache, req, packet_len))
+            new_pkt = sr_arppool_get_packet(cache, packet_len);
+        
+        if (new_pkt) {
+            new_pkt->buf = (uint8_t *)(new_pkt + 1);
+            memcpy(new_pkt->buf, packet, packet_len);
+            new_pkt->len = packet_len;
+            new_pkt->ifindex = ifindex;
+            /* keep arrival order, the reply sends them first to last */
+            new_pkt->next = NULL;
+            if (req->packets_tail)
+                req->packets_tail->next = new_pkt;
+            else
+                req->packets = new_pkt;
+            req->packets_tail = new_pkt;
+            req->n_packets++;
+            req->n_bytes += packet_len;
+            cache->n_queued++;
+            cache->n_queued_bytes += packet_len;
+        }
+        else {
+            cache->tail_drops++;
+        }
     }
     
     pthread_mutex_unlock(&(cache->lock));
@@ -138,83 +650,97 @@ struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
 /* This method performs two functions:
    1) Looks up this IP in the request queue. If it is found, returns a pointer
       to the sr_arpreq with this IP. Otherwise, returns NULL.
-   2) Inserts this IP to MAC mapping in the cache, and marks it valid. */
+   2) Inserts this IP to MAC mapping, learned on interface ifindex, in the
+      cache, and marks it valid. */
 struct sr_arpreq *sr_arpcache_insert(struct sr_arpcache *cache,
                                      unsigned char *mac,
-                                     uint32_t ip)
+                                     uint32_t ip,
+                                     int ifindex)
 {
     pthread_mutex_lock(&(cache->lock));
     
-    struct sr_arpreq *req, *prev = NULL, *next = NULL; 
-    for (req = cache->requests; req != NULL; req = req->next) {
-        if (req->ip == ip) {            
-            if (prev) {
-                next = req->next;
-                prev->next = next;
-            } 
-            else {
-                next = req->next;
-                cache->requests = next;
-            }
-            
-            break;
-        }
-        prev = req;
-    }
-    
-    int i;
-    for (i = 0; i < SR_ARPCACHE_SZ; i++) {
-        if (!(cache->entries[i].valid))
-            break;
-    }
+    struct sr_arpreq *req = sr_arpreq_find(cache, ip);
+    if (req)
+        sr_arpreq_unlink(cache, req);
     
-    if (i != SR_ARPCACHE_SZ) {
-        memcpy(cache->entries[i].mac, mac, 6);
-        cache->entries[i].ip = ip;
-        cache->entries[i].added = time(NULL);
-        cache->entries[i].valid = 1;
-    }
+    if (ip)
+        sr_arpcache_store(cache, ip, mac, ifindex, 1, time(NULL));
     
     pthread_mutex_unlock(&(cache->lock));
     
     return req;
 }
 
+/* Stores ip's mapping as learned at added, or with valid 0 a negative entry
+   saying ip did not answer (which never replaces a mapping). Call with the
+   lock held. */
+static void sr_arpcache_store(struct sr_arpcache *cache, uint32_t ip,
+                              const unsigned char *mac, int ifindex, int valid,
+                              time_t added) {
+    int i = sr_arpcache_find(cache, ip);
+    uint32_t gen = 0;
+    
+    if (!valid && i >= 0 && cache->entries[i].valid)
+        return;
+    
+    if (i < 0 && cache->n_entries >= cache->max_entries &&
+        sr_arpcache_evict(cache, ip, !valid) != 0)
+        return;
+    
+    /* a new entry without a timer would never expire. Its generation
+       tells its timer apart from any left by an earlier entry for ip */
+    if (i < 0) {
+        if (++cache->timer_gen == 0)
+            ++cache->timer_gen;
+        gen = cache->timer_gen;
+        if (sr_arpcache_set_timer(cache, ip, gen, valid ?
+                                  added + (time_t) (SR_ARPCACHE_TO - SR_ARPCACHE_REFRESH) :
+                                  added + (time_t) SR_ARPCACHE_NEG_TO) != 0)
+            return;
+    }
+    
+    if (i < 0) {
+        if ((cache->n_entries + 1) * 2 > cache->n_slots)
+            sr_arpcache_grow(cache);
+        
+        i = sr_arpcache_hash(ip) & (cache->n_slots - 1);
+        while (cache->entries[i].ip)
+            i = (i + 1) & (cache->n_slots - 1);
+        cache->n_entries++;
+        cache->entries[i].gen = gen;
+    }
+    
+    sr_arpcache_write_begin(cache);
+    cache->entries[i].ip = ip;
+    if (mac)
+        memcpy(cache->entries[i].mac, mac, 6);
+    else
+        memset(cache->entries[i].mac, 0, 6);
+    cache->entries[i].added = added;
+    cache->entries[i].valid = valid;
+    cache->entries[i].ifindex = ifindex;
+    cache->entries[i].used = 0;
+    sr_arpcache_write_end(cache);
+}
+
 /* Frees all memory associated with this arp request entry. If this arp request
    entry is on the arp request queue, it is removed from the queue. */
 void sr_arpreq_destroy(struct sr_arpcache *cache, struct sr_arpreq *entry) {
     pthread_mutex_lock(&(cache->lock));
     
     if (entry) {
-        struct sr_arpreq *req, *prev = NULL, *next = NULL; 
-        for (req = cache->requests; req != NULL; req = req->next) {
-            if (req == entry) {                
-                if (prev) {
-                    next = req->next;
-                    prev->next = next;
-                } 
-                else {
-                    next = req->next;
-                    cache->requests = next;
-                }
-                
-                break;
-            }
-            prev = req;
-        }
+        /* sr_arpcache_insert() may already have taken it off the queue */
+        if (sr_arpreq_find(cache, entry->ip) == entry)
+            sr_arpreq_unlink(cache, entry);
         
         struct sr_packet *pkt, *nxt;
         
         for (pkt = entry->packets; pkt; pkt = nxt) {
             nxt = pkt->next;
-            if (pkt->buf)
-                free(pkt->buf);
-            if (pkt->iface)
-                free(pkt->iface);
-            free(pkt);
+            sr_arpreq_free_packet(cache, entry, pkt);
         }
         
-        free(entry);
+        sr_arppool_put(&(cache->req_pool), entry);
     }
     
     pthread_mutex_unlock(&(cache->lock));
@@ -225,9 +751,11 @@ void sr_arpcache_dump(struct sr_arpcache *cache) {
     fprintf(stderr, "\nMAC            IP         ADDED                      VALID\n");
     fprintf(stderr, "-----------------------------------------------------------\n");
     
-    int i;
-    for (i = 0; i < SR_ARPCACHE_SZ; i++) {
+    unsigned int i;
+    for (i = 0; i < cache->n_slots; i++) {
         struct sr_arpentry *cur = &(cache->entries[i]);
+        if (!cur->ip)
+            continue;
         unsigned char *mac = cur->mac;
         fprintf(stderr, "%.1x%.1x%.1x%.1x%.1x%.1x   %.8x   %.24s   %d\n", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], ntohl(cur->ip), ctime(&(cur->added)), cur->valid);
     }
@@ -235,14 +763,152 @@ void sr_arpcache_dump(struct sr_arpcache *cache) {
     fprintf(stderr, "\n");
 }
 
+/* Prints the pending packet queue occupancy and drop counters. */
+void sr_arpcache_print_stats(struct sr_arpcache *cache) {
+    pthread_mutex_lock(&(cache->lock));
+    printf("ARP queue: %u requests, %u packets (%u bytes) waiting, "
+           "%lu tail drops, %lu oldest drops\n",
+           cache->n_requests, cache->n_queued, cache->n_queued_bytes,
+           cache->tail_drops, cache->oldest_drops);
+    
+    int c;
+    printf("ARP pools: requests %u in use, %u free, %u slabs\n",
+           cache->req_pool.in_use, cache->req_pool.n_free, cache->req_pool.n_slabs);
+    for (c = 0; c < SR_ARPPOOL_CLASSES; c++) {
+        struct sr_arppool *pool = &(cache->pkt_pools[c]);
+        printf("           %u byte packets %u in use, %u free, %u slabs\n",
+               pool->size, pool->in_use, pool->n_free, pool->n_slabs);
+    }
+    printf("           %lu packets too big for a pool\n", cache->pkt_mallocs);
+    pthread_mutex_unlock(&(cache->lock));
+}
+
+/* Writes the valid entries to filename, one "ip mac interface" line each.
+   Interfaces are saved by name since indices are only good for one run.
+   The file is written under a temporary name and renamed into place.
+   Returns 0 on success. */
+int sr_arpcache_save(struct sr_instance *sr, const char *filename) {
+    struct sr_arpcache *cache = &(sr->cache);
+    char tmpname[1024];
+    struct in_addr addr;
+    struct sr_if *iface;
+    unsigned int i;
+    FILE *fp;
+    int ok;
+    
+    snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+    if ((fp = fopen(tmpname, "w")) == NULL) {
+        perror("fopen");
+        return -1;
+    }
+    
+    pthread_mutex_lock(&(cache->lock));
+    for (i = 0; i < cache->n_slots; i++) {
+        struct sr_arpentry *e = &(cache->entries[i]);
+        if (!e->ip || !e->valid)
+            continue;
+        if ((iface = sr_get_interface_idx(sr, e->ifindex)) == NULL)
+            continue;
+        addr.s_addr = e->ip;
+        fprintf(fp, "%s %02x:%02x:%02x:%02x:%02x:%02x %s\n", inet_ntoa(addr),
+                e->mac[0], e->mac[1], e->mac[2], e->mac[3], e->mac[4], e->mac[5],
+                iface->name);
+    }
+    pthread_mutex_unlock(&(cache->lock));
+    
+    ok = !ferror(fp);
+    if (fclose(fp) != 0)
+        ok = 0;
+    if (!ok || rename(tmpname, filename) != 0) {
+        perror("sr_arpcache_save");
+        unlink(tmpname);
+        return -1;
+    }
+    return 0;
+}
+
+/* Reads entries written by sr_arpcache_save(). They come back as if learned
+   SR_ARPCACHE_TO - SR_ARPCACHE_REFRESH seconds ago: the first use sends a
+   refresh probe, and an entry is dropped a few seconds later unless it is
+   used and verified. Lines that do not parse and entries on interfaces we
+   no longer have are skipped. Returns the number of entries restored. */
+unsigned int sr_arpcache_load(struct sr_instance *sr, const char *filename) {
+    struct sr_arpcache *cache = &(sr->cache);
+    char line[128], ipstr[32], ifname[sr_IFACE_NAMELEN];
+    unsigned int mac[6], n = 0;
+    unsigned char bytes[6];
+    struct in_addr addr;
+    int ifindex, k;
+    time_t added = time(NULL) - (time_t) (SR_ARPCACHE_TO - SR_ARPCACHE_REFRESH);
+    FILE *fp = fopen(filename, "r");
+    
+    if (!fp)
+        return 0;
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "%31s %x:%x:%x:%x:%x:%x %31s", ipstr, &mac[0], &mac[1],
+                   &mac[2], &mac[3], &mac[4], &mac[5], ifname) != 8 ||
+            inet_aton(ipstr, &addr) == 0 || addr.s_addr == 0)
+            continue;
+        if ((ifindex = sr_get_ifindex(sr, ifname)) == SR_IF_NONE)
+            continue;
+        for (k = 0; k < 6; k++)
+            bytes[k] = (unsigned char) mac[k];
+        pthread_mutex_lock(&(cache->lock));
+        sr_arpcache_store(cache, addr.s_addr, bytes, ifindex, 1, added);
+        pthread_mutex_unlock(&(cache->lock));
+        n++;
+    }
+    fclose(fp);
+    return n;
+}
+
 /* Initialize table + table lock. Returns 0 on success. */
-int sr_arpcache_init(struct sr_arpcache *cache) {  
+int sr_arpcache_init(struct sr_arpcache *cache, unsigned int max_entries,
+                     const struct sr_arpq_limits *limits) {  
     /* Seed RNG to kick out a random entry if all entries full. */
     srand(time(NULL));
     
-    /* Invalidate all entries */
-    memset(cache->entries, 0, sizeof(cache->entries));
+    /* Start small, the table doubles up to twice max_entries slots */
+    cache->max_entries = max_entries ? max_entries : SR_ARPCACHE_SZ;
+    cache->n_slots = SR_ARPCACHE_INIT_SLOTS;
+    cache->n_entries = 0;
+    cache->evictions = 0;
+    cache->seq = 0;
+    cache->n_retired = 0;
+    cache->entries = (struct sr_arpentry *) calloc(cache->n_slots, sizeof(struct sr_arpentry));
+    if (!cache->entries)
+        return -1;
     cache->requests = NULL;
+    cache->n_requests = 0;
+    cache->n_req_buckets = SR_ARPCACHE_REQ_BUCKETS;
+    cache->req_buckets = (struct sr_arpreq **) calloc(cache->n_req_buckets, sizeof(struct sr_arpreq *));
+    if (!cache->req_buckets)
+        return -1;
+    
+    if (limits)
+        cache->limits = *limits;
+    else
+        memset(&(cache->limits), 0, sizeof(cache->limits));
+    if (!cache->limits.req_packets)
+        cache->limits.req_packets = SR_ARPQ_REQ_PACKETS;
+    if (!cache->limits.req_bytes)
+        cache->limits.req_bytes = SR_ARPQ_REQ_BYTES;
+    if (!cache->limits.max_packets)
+        cache->limits.max_packets = SR_ARPQ_MAX_PACKETS;
+    if (!cache->limits.max_bytes)
+        cache->limits.max_bytes = SR_ARPQ_MAX_BYTES;
+    cache->n_queued = 0;
+    cache->n_queued_bytes = 0;
+    cache->tail_drops = 0;
+    cache->oldest_drops = 0;
+    sr_arppool_init(&(cache->req_pool), sizeof(struct sr_arpreq));
+    unsigned int c;
+    for (c = 0; c < SR_ARPPOOL_CLASSES; c++)
+        sr_arppool_init(&(cache->pkt_pools[c]), SR_ARPPOOL_MIN << c);
+    cache->pkt_mallocs = 0;
+    memset(cache->wheel, 0, sizeof(cache->wheel));
+    cache->wheel_now = time(NULL);
+    cache->timer_gen = 0;
     
     /* Acquire mutex lock */
     pthread_mutexattr_init(&(cache->attr));
@@ -254,11 +920,26 @@ int sr_arpcache_init(struct sr_arpcache *cache) {
 
 /* Destroys table + table lock. Returns 0 on success. */
 int sr_arpcache_destroy(struct sr_arpcache *cache) {
+    while (cache->n_retired)
+        free(cache->retired[--cache->n_retired]);
+    free(cache->entries);
+    cache->entries = NULL;
+    free(cache->req_buckets);
+    cache->req_buckets = NULL;
+    unsigned int k;
+    for (k = 0; k < SR_ARPCACHE_WHEEL; k++) {
+        free(cache->wheel[k].timers);
+        cache->wheel[k].timers = NULL;
+    }
+    sr_arppool_destroy(&(cache->req_pool));
+    for (k = 0; k < SR_ARPPOOL_CLASSES; k++)
+        sr_arppool_destroy(&(cache->pkt_pools[k]));
     return pthread_mutex_destroy(&(cache->lock)) && pthread_mutexattr_destroy(&(cache->attr));
 }
 
-/* Thread which sweeps through the cache and invalidates entries that were added
-   more than SR_ARPCACHE_TO seconds ago. */
+/* Thread which turns the timer wheel once a second, invalidating entries that
+   were added more than SR_ARPCACHE_TO seconds ago and handling the requests
+   that are due. */
 void *sr_arpcache_timeout(void *sr_ptr) {
     struct sr_instance *sr = sr_ptr;
     struct sr_arpcache *cache = &(sr->cache);
@@ -270,14 +951,21 @@ void *sr_arpcache_timeout(void *sr_ptr) {
     
         time_t curtime = time(NULL);
         
-        int i;    
-        for (i = 0; i < SR_ARPCACHE_SZ; i++) {
-            if ((cache->entries[i].valid) && (difftime(curtime,cache->entries[i].added) > SR_ARPCACHE_TO)) {
-                cache->entries[i].valid = 0;
-            }
+        /* sweeping can send ICMP, which looks up routes */
+        int fib_slot = sr_fib_read_lock(&(sr->fib_rcu));
+        
+        /* catch up on seconds we slept through, but after a clock jump
+           one full turn has seen every slot */
+        unsigned int turns = 0;
+        while (cache->wheel_now < curtime && turns++ < SR_ARPCACHE_WHEEL) {
+            cache->wheel_now++;
+            sr_arpcache_expire(sr, curtime);
+            sr_arpcache_sweepreqs(sr);
         }
+        if (cache->wheel_now < curtime)
+            cache->wheel_now = curtime;
         
-        sr_arpcache_sweepreqs(sr);
+        sr_fib_read_unlock(&(sr->fib_rcu), fib_slot);
 
         pthread_mutex_unlock(&(cache->lock));
     }
@@ -4,6 +4,57 @@
    to that ARP cache request. The ARP cache entries hold IP->MAC mappings and
    are timed out every SR_ARPCACHE_TO seconds.
 
+   The entries live in an open addressed hash table keyed by IP that grows
+   as needed up to a configurable number of entries (SR_ARPCACHE_SZ by
+   default). Inserting into a full cache evicts the oldest of the
+   SR_ARPCACHE_EVICT_SCAN entries following the new IP's home slot. A
+   negative entry may only evict another negative entry, and is not
+   stored if there is none there.
+
+   Writers hold the lock and bracket every change to the table with a
+   sequence number (odd while a change is in progress), so the forwarding
+   path can use sr_arpcache_lookup_mac(), which takes no lock, allocates
+   nothing and retries if the table changed while it was reading. Tables
+   replaced by growing are kept until sr_arpcache_destroy() since a
+   reader may still be probing one.
+
+   Pending requests are kept both on the cache->requests list, which the
+   sweep walks, and in a chained hash table keyed by target IP, so finding
+   a request or taking it off the queue does not scan the list.
+
+   Packets waiting on requests are capped per request and across the whole
+   queue, both in packets and in bytes (see struct sr_arpq_limits). A
+   packet that does not fit is dropped, or with SR_ARPQ_DROP_OLDEST the
+   request's oldest packets are dropped to make room for it. Dropped
+   packets are gone for good: no ICMP is ever sent for them.
+
+   Requests and queued packets come from pools of fixed size objects
+   carved out of SR_ARPPOOL_SLAB byte slabs, one pool for requests and
+   one per packet size class. Freed objects go back on their pool's free
+   list; slabs are only returned by sr_arpcache_destroy(), so the queue
+   limits above also bound what the pools hold on to.
+
+   Entry expiry and request retransmission are driven by a timing wheel
+   of SR_ARPCACHE_WHEEL one second slots. Each slot holds the entries
+   (by IP) that expire and the requests that are due in that second, so
+   the timeout thread only looks at work that is actually due.
+
+   Entries the forwarding path has used are refreshed ahead of time: for
+   the last SR_ARPCACHE_REFRESH seconds before they expire, a unicast ARP
+   request goes to the owner every second the entry is used. An entry
+   still in use stays usable past SR_ARPCACHE_TO until a reply refreshes
+   it, for at most SR_ARPCACHE_STALE_TO seconds.
+
+   An IP that never answered its ARP requests gets a negative entry (valid
+   0, no MAC) for SR_ARPCACHE_NEG_TO seconds. Lookups return it like any
+   other entry, and the forwarding path refuses packets for it at once
+   rather than queueing them behind a new round of requests.
+
+   sr_arpcache_save() writes the valid entries to a text file, which
+   sr_arpcache_init() can load back after a restart. Restored entries are
+   stale: they are used right away, and the first use sends a unicast
+   probe to confirm them.
+
    Pseudocode for use of these structures follows.
 
    --
@@ -71,21 +122,49 @@
 #include <pthread.h>
 #include "sr_if.h"
 
-#define SR_ARPCACHE_SZ    100  
+#define SR_ARPCACHE_SZ    4096  /* default most entries */
 #define SR_ARPCACHE_TO    15.0
+#define SR_ARPCACHE_REFRESH 3.0   /* probe used entries this long before expiry */
+#define SR_ARPCACHE_STALE_TO 5.0  /* keep used entries this long past expiry */
+#define SR_ARPCACHE_NEG_TO 10.0   /* remember unanswered IPs this long */
+#define SR_ARPCACHE_INIT_SLOTS 64
+#define SR_ARPCACHE_EVICT_SCAN 8
+#define SR_ARPCACHE_MAX_RETIRED 32
+#define SR_ARPCACHE_REQ_BUCKETS 64  /* initial request table size */
+#define SR_ARPPOOL_SLAB    (64 * 1024)   /* bytes a pool grows by */
+#define SR_ARPPOOL_ALIGN   16
+#define SR_ARPPOOL_MIN     128  /* smallest packet class, sr_packet included */
+#define SR_ARPPOOL_CLASSES 5    /* 128 to 2048 bytes, doubling */
+#define SR_ARPCACHE_WHEEL 32   /* timer wheel slots (seconds), a power of two
+                                  above SR_ARPCACHE_TO */
+
+/* default caps on packets waiting for ARP replies */
+#define SR_ARPQ_REQ_PACKETS 64
+#define SR_ARPQ_REQ_BYTES   (64 * 1514)
+#define SR_ARPQ_MAX_PACKETS 8192
+#define SR_ARPQ_MAX_BYTES   (8 * 1024 * 1024)
+
+/* what to drop when a packet does not fit */
+#define SR_ARPQ_DROP_TAIL   0   /* the new packet */
+#define SR_ARPQ_DROP_OLDEST 1   /* the request's oldest packets */
 
 struct sr_packet {
-    uint8_t *buf;               /* A raw Ethernet frame, presumably with the dest MAC empty */
+    uint8_t *buf;               /* A raw Ethernet frame, presumably with the dest MAC empty,
+                                   allocated along with the sr_packet */
     unsigned int len;           /* Length of raw Ethernet frame */
-    char *iface;                /* The outgoing interface */
+    int ifindex;                /* The outgoing interface */
+    int pool;                   /* size class it came from, -1 if malloced */
     struct sr_packet *next;
 };
 
 struct sr_arpentry {
     unsigned char mac[6]; 
-    uint32_t ip;                /* IP addr in network byte order */
+    uint32_t ip;                /* IP addr in network byte order, 0 if unused */
     time_t added;         
-    int valid;
+    int valid;                  /* 0 for a negative entry */
+    int ifindex;                /* interface the mapping was learned on */
+    volatile int used;          /* looked up since the last refresh probe */
+    uint32_t gen;               /* matches the one timer that is this entry's */
 };
 
 struct sr_arpreq {
@@ -95,13 +174,76 @@ struct sr_arpreq {
                                    never sent, will be 0. */
     uint32_t times_sent;        /* Number of times this request was sent. You 
                                    should update this. */
-    struct sr_packet *packets;  /* List of pkts waiting on this req to finish */
+    struct sr_packet *packets;  /* List of pkts waiting on this req to finish,
+                                   oldest first */
+    struct sr_packet *packets_tail; /* newest, new packets go after it */
+    unsigned int n_packets;     /* length of packets */
+    unsigned int n_bytes;       /* frame bytes on packets */
     struct sr_arpreq *next;
+    struct sr_arpreq *prev;     /* previous on cache->requests */
+    struct sr_arpreq *hnext;    /* next in the same request hash bucket */
+    time_t due;                 /* second the sweep next looks at it */
+    struct sr_arpreq *tnext;    /* others due in the same wheel slot */
+    struct sr_arpreq *tprev;
+};
+
+/* entry expiry scheduled on the timer wheel */
+struct sr_arptimer {
+    uint32_t ip;
+    uint32_t gen;               /* entry's gen when set, stale if it differs */
+    time_t when;
+};
+
+struct sr_arpwheel_slot {
+    struct sr_arptimer *timers; /* entries expiring in this second */
+    unsigned int n_timers;
+    unsigned int cap_timers;
+    struct sr_arpreq *reqs;     /* requests due in this second */
+};
+
+/* fixed size objects handed out from slabs */
+struct sr_arppool {
+    unsigned int size;          /* object size, a multiple of SR_ARPPOOL_ALIGN */
+    void *free;                 /* free objects, linked through their first word */
+    void *slabs;                /* linked through their first word */
+    unsigned int n_slabs;
+    unsigned int in_use;
+    unsigned int n_free;
+};
+
+/* 0 in any field means the default */
+struct sr_arpq_limits {
+    unsigned int req_packets;   /* per request */
+    unsigned int req_bytes;
+    unsigned int max_packets;   /* whole queue */
+    unsigned int max_bytes;
+    int policy;                 /* SR_ARPQ_DROP_TAIL or SR_ARPQ_DROP_OLDEST */
 };
 
 struct sr_arpcache {
-    struct sr_arpentry entries[SR_ARPCACHE_SZ];
+    struct sr_arpentry * volatile entries; /* hash table of n_slots, a power of two */
+    volatile unsigned int n_slots;
+    volatile unsigned int seq;  /* odd while a writer changes the table */
+    struct sr_arpentry *retired[SR_ARPCACHE_MAX_RETIRED];
+    unsigned int n_retired;
+    unsigned int n_entries;
+    unsigned int max_entries;   /* evict to stay at or below this */
+    unsigned long evictions;
     struct sr_arpreq *requests;
+    struct sr_arpreq **req_buckets; /* requests by IP, n_req_buckets a power of two */
+    unsigned int n_req_buckets;
+    unsigned int n_requests;
+    struct sr_arpq_limits limits;
+    unsigned int n_queued;      /* packets waiting on all requests */
+    unsigned int n_queued_bytes;
+    unsigned long tail_drops;   /* new packets that did not fit */
+    unsigned long oldest_drops; /* queued packets pushed out by new ones */
+    struct sr_arppool req_pool;
+    struct sr_arppool pkt_pools[SR_ARPPOOL_CLASSES];
+    unsigned long pkt_mallocs;  /* packets too big for any class */
+    struct sr_arpwheel_slot wheel[SR_ARPCACHE_WHEEL];
+    time_t wheel_now;           /* last second the wheel was turned to */
+    uint32_t timer_gen;         /* last gen given to a new entry */
     pthread_mutex_t lock;
     pthread_mutexattr_t attr;
 };
@@ -110,10 +252,16 @@ struct sr_arpcache {
    You must free the returned structure if it is not NULL. */
 struct sr_arpentry *sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip);
 
+/* Copies the entry for IP (network byte order) into *entry and returns 1,
+   or returns 0 if there is none. A negative entry comes back with valid
+   0. Never locks or allocates. */
+int sr_arpcache_lookup_mac(struct sr_arpcache *cache, uint32_t ip,
+                           struct sr_arpentry *entry);
+
 /* Adds an ARP request to the ARP request queue. If the request is already on
    the queue, adds the packet to the linked list of packets for this sr_arpreq
-   that corresponds to this ARP request. The packet argument should not be
-   freed by the caller.
+   that corresponds to this ARP request, subject to the queue limits. The
+   packet argument should not be freed by the caller.
 
    A pointer to the ARP request is returned; it should be freed. The caller
    can remove the ARP request from the queue by calling sr_arpreq_destroy. */
@@ -121,15 +269,17 @@ struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
                          uint32_t ip,
                          uint8_t *packet,               /* borrowed */
                          unsigned int packet_len,
-                         char *iface);
+                         int ifindex);
 
 /* This method performs two functions:
    1) Looks up this IP in the request queue. If it is found, returns a pointer
       to the sr_arpreq with this IP. Otherwise, returns NULL.
-   2) Inserts this IP to MAC mapping in the cache, and marks it valid. */
+   2) Inserts this IP to MAC mapping, learned on interface ifindex, in the
+      cache, and marks it valid. */
 struct sr_arpreq *sr_arpcache_insert(struct sr_arpcache *cache,
                                      unsigned char *mac,
-                                     uint32_t ip);
+                                     uint32_t ip,
+                                     int ifindex);
 
 /* Frees all memory associated with this arp request entry. If this arp request
    entry is on the arp request queue, it is removed from the queue. */
@@ -138,12 +288,26 @@ void sr_arpreq_destroy(struct sr_arpcache *cache, struct sr_arpreq *entry);
 /* Prints out the ARP table. */
 void sr_arpcache_dump(struct sr_arpcache *cache);
 
+/* Prints the pending packet queue occupancy, drop counters and pool use. */
+void sr_arpcache_print_stats(struct sr_arpcache *cache);
+
+/* Writes the valid entries of sr's cache to filename for a later
+   sr_arpcache_load(). Returns 0 on success. */
+int sr_arpcache_save(struct sr_instance *sr, const char *filename);
+
+/* Restores entries saved by sr_arpcache_save() as stale, mapping them onto
+   the current interfaces by name. Call once the interfaces are known.
+   Returns the number of entries restored. */
+unsigned int sr_arpcache_load(struct sr_instance *sr, const char *filename);
+
 /* You shouldn't have to call these methods--they're already called in the
    starter code for you. The init call is a constructor, the destroy call is
-   a destructor, and a cleanup thread times out cache entries every 15
-   seconds. */
+   a destructor, and a cleanup thread turns the timer wheel once a
+   second, timing out cache entries after 15 seconds. max_entries of 0
+   means SR_ARPCACHE_SZ, limits of NULL means the default queue limits. */
 
-int   sr_arpcache_init(struct sr_arpcache *cache);
+int   sr_arpcache_init(struct sr_arpcache *cache, unsigned int max_entries,
+                       const struct sr_arpq_limits *limits);
 int   sr_arpcache_destroy(struct sr_arpcache *cache);
 void *sr_arpcache_timeout(void *cache_ptr);
 
@@ -0,0 +1,125 @@
+/* Checks that packets queued on an ARP request come back out in the order
+   they arrived once the reply is in, with and without a per request cap
+   and under both drop policies. Two requests are filled interleaved, with
+   packet sizes spread over all the pool size classes.
+
+   Links against sr_arpcache.o alone; the router functions it calls are
+   stubbed out below. Built and run by "make test". */
+
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "sr_arpcache.h"
+#include "sr_router.h"
+
+#define TEST_PACKETS 40
+
+void send_arprequest(struct sr_instance *sr, uint32_t ip, int ifindex) {}
+void send_arprequest_to(struct sr_instance *sr, uint32_t ip,
+                        const uint8_t *dhost, int ifindex) {}
+void handle_icmp(struct sr_instance *sr, uint8_t *packet, int len,
+                 struct sr_if *iface, int type, int code) {}
+int sr_fib_read_lock(struct sr_fib_rcu *rcu) { return 0; }
+void sr_fib_read_unlock(struct sr_fib_rcu *rcu, int slot) {}
+struct sr_if *sr_get_interface_idx(struct sr_instance *sr, int index) { return 0; }
+int sr_get_ifindex(struct sr_instance *sr, const char *name) { return SR_IF_NONE; }
+
+static int failures = 0;
+
+/* Packet k is tagged with k in its first bytes and has a length that
+   depends on k, so both can be checked after it comes back. */
+static unsigned int test_len(int k) {
+    return 60 + (k * 397) % 1455;
+}
+
+static void check(int ok, const char *what, int policy, unsigned int cap) {
+    if (!ok) {
+        fprintf(stderr, "FAIL: %s (policy %d, cap %u)\n", what, policy, cap);
+        failures++;
+    }
+}
+
+/* Resolves ip and checks its packets are first..first+n-1 (every other
+   tag, since the two requests were filled interleaved) in that order. */
+static void check_order(struct sr_arpcache *cache, uint32_t ip, int first,
+                        int n, int policy, unsigned int cap) {
+    unsigned char mac[ETHER_ADDR_LEN] = { 2, 0, 0, 0, 0, 1 };
+    struct sr_arpreq *req = sr_arpcache_insert(cache, mac, ip, 0);
+    struct sr_packet *pkt, *last = 0;
+    int seen = 0, tag;
+
+    check(req != 0, "request not found on insert", policy, cap);
+    if (!req)
+        return;
+
+    for (pkt = req->packets; pkt; pkt = pkt->next) {
+        memcpy(&tag, pkt->buf, sizeof(tag));
+        check(tag == first + 2 * seen, "packet out of order", policy, cap);
+        check(pkt->len == test_len(tag), "packet length changed", policy, cap);
+        last = pkt;
+        seen++;
+    }
+    check(seen == n, "wrong number of packets", policy, cap);
+    check(req->n_packets == (unsigned int)n, "n_packets is off", policy, cap);
+    check(req->packets_tail == last, "packets_tail is not the last packet",
+          policy, cap);
+
+    sr_arpreq_destroy(cache, req);
+}
+
+static void run(int policy, unsigned int cap) {
+    struct sr_arpcache cache;
+    struct sr_arpq_limits limits;
+    uint8_t packet[1514];
+    uint32_t ip[2];
+    unsigned int n = TEST_PACKETS / 2;
+    int k;
+
+    memset(&limits, 0, sizeof(limits));
+    limits.req_packets = cap;
+    limits.policy = policy;
+    sr_arpcache_init(&cache, 0, &limits);
+
+    ip[0] = htonl(0x0a000001);
+    ip[1] = htonl(0x0a000002);
+    memset(packet, 0, sizeof(packet));
+    for (k = 0; k < TEST_PACKETS; k++) {
+        memcpy(packet, &k, sizeof(k));
+        sr_arpcache_queuereq(&cache, ip[k & 1], packet, test_len(k), 0);
+    }
+
+    /* a cap keeps the first cap packets, or the last cap with DROP_OLDEST */
+    if (cap && cap < n) {
+        if (policy == SR_ARPQ_DROP_OLDEST) {
+            check_order(&cache, ip[0], 2 * (n - cap), cap, policy, cap);
+            check_order(&cache, ip[1], 2 * (n - cap) + 1, cap, policy, cap);
+        } else {
+            check_order(&cache, ip[0], 0, cap, policy, cap);
+            check_order(&cache, ip[1], 1, cap, policy, cap);
+        }
+    } else {
+        check_order(&cache, ip[0], 0, n, policy, cap);
+        check_order(&cache, ip[1], 1, n, policy, cap);
+    }
+
+    check(cache.n_queued == 0, "packets left queued", policy, cap);
+    sr_arpcache_destroy(&cache);
+}
+
+int main(void) {
+    int policy;
+
+    for (policy = SR_ARPQ_DROP_TAIL; policy <= SR_ARPQ_DROP_OLDEST; policy++) {
+        run(policy, 0);
+        run(policy, 1);
+        run(policy, 8);
+    }
+
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("ARP queue order: all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,1151 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_fib.c
+ *
+ * Description:
+ *
+ * Path-compressed trie used for longest prefix match on the forwarding
+ * path.  Nodes live in one growable array and refer to each other by
+ * index, which keeps them dense in cache.  The optional DIR-24-8 mode
+ * trades 64MB of tables for a one or two access lookup.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "sr_fib.h"
+#include "sr_rt.h"
+#include "sr_if.h"
+#include "sr_router.h"
+
+#define SR_FIB_INIT_NODES 64
+#define SR_FIB_INIT_TBL8  16
+#define SR_FIB_TBL24_SZ   (1 << 24)
+#define SR_FIB_INIT_NH    16
+
+/* netmask for a prefix of length plen, host byte order */
+#define SR_FIB_MASK(plen) ((plen) ? (0xffffffff << (32 - (plen))) : 0)
+
+/* bit number pos (0 is the most significant) of a host order address */
+#define SR_FIB_BIT(addr, pos) (((addr) >> (31 - (pos))) & 1)
+
+
+/* source of sr_fib.generation, 0 is never handed out */
+static uint32_t sr_fib_last_generation = 0;
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_mask_len(..)
+ * Scope:  Global
+ *
+ * Convert a netmask to a prefix length.  Non-contiguous masks are
+ * truncated at the first zero bit.
+ *
+ *---------------------------------------------------------------------*/
+
+uint8_t sr_fib_mask_len(uint32_t mask_nbo)
+{
+    uint32_t mask = ntohl(mask_nbo);
+    uint8_t plen = 0;
+
+    while(plen < 32 && (mask & (0x80000000 >> plen)))
+    { plen++; }
+
+    if(mask != SR_FIB_MASK(plen))
+    {
+        fprintf(stderr, "*warning* non-contiguous netmask %08x, using /%d\n",
+                mask, plen);
+    }
+
+    return plen;
+} /* -- sr_fib_mask_len -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_new_node(..)
+ * Scope:  Local
+ *
+ * Append a node to the node array, growing it if needed.  Returns the
+ * index of the new node.  Indices stay valid across growth, pointers
+ * into fib->nodes do not.
+ *
+ *---------------------------------------------------------------------*/
+
+static uint32_t sr_fib_new_node(struct sr_fib* fib, uint32_t key,
+                                uint8_t plen, uint32_t nh)
+{
+    struct sr_fib_node* node = 0;
+
+    if(fib->n_nodes == fib->cap_nodes)
+    {
+        fib->cap_nodes *= 2;
+        fib->nodes = (struct sr_fib_node*)realloc(fib->nodes,
+                fib->cap_nodes * sizeof(struct sr_fib_node));
+        assert(fib->nodes);
+    }
+
+    node = &(fib->nodes[fib->n_nodes]);
+    node->key = key & SR_FIB_MASK(plen);
+    node->plen = plen;
+    node->nh = nh;
+    node->child[0] = 0;
+    node->child[1] = 0;
+
+    return fib->n_nodes++;
+} /* -- sr_fib_new_node -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_insert(..)
+ * Scope:  Local
+ *
+ * Insert prefix/plen into the trie.  An existing entry for the same
+ * prefix is overwritten, so later routing table lines win as before.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_fib_insert(struct sr_fib* fib, uint32_t prefix, uint8_t plen,
+                          uint32_t nh)
+{
+    uint32_t cur = 0, next = 0, split = 0, leaf = 0, diff = 0;
+    uint8_t common = 0, limit = 0;
+    int b;
+
+    prefix &= SR_FIB_MASK(plen);
+
+    while(1)
+    {
+        /* -- invariant: nodes[cur] covers prefix and is no longer -- */
+        if(fib->nodes[cur].plen == plen)
+        {
+            fib->nodes[cur].nh = nh;
+            return;
+        }
+
+        b = SR_FIB_BIT(prefix, fib->nodes[cur].plen);
+        next = fib->nodes[cur].child[b];
+        if(next == 0)
+        {
+            leaf = sr_fib_new_node(fib, prefix, plen, nh);
+            fib->nodes[cur].child[b] = leaf;
+            return;
+        }
+
+        /* -- length of the prefix shared with the child -- */
+        limit = fib->nodes[next].plen < plen ? fib->nodes[next].plen : plen;
+        diff = fib->nodes[next].key ^ prefix;
+        common = diff ? (uint8_t)__builtin_clz(diff) : 32;
+        if(common > limit)
+        { common = limit; }
+
+        if(common == fib->nodes[next].plen)
+        {
+            cur = next;
+            continue;
+        }
+
+        /* -- child diverges from us or is longer than us: split -- */
+        if(common == plen)
+        {
+            split = sr_fib_new_node(fib, prefix, plen, nh);
+        }
+        else
+        {
+            split = sr_fib_new_node(fib, prefix, common, SR_FIB_NO_NH);
+            leaf = sr_fib_new_node(fib, prefix, plen, nh);
+            fib->nodes[split].child[SR_FIB_BIT(prefix, common)] = leaf;
+        }
+        fib->nodes[split].child[SR_FIB_BIT(fib->nodes[next].key, common)] = next;
+        fib->nodes[cur].child[b] = split;
+        return;
+    }
+} /* -- sr_fib_insert -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_dir_fill(..)
+ * Scope:  Local
+ *
+ * Point every DIR-24-8 slot covered by prefix/plen at nh.  Prefixes
+ * must be filled shortest first so longer ones overwrite them.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_fib_dir_fill(struct sr_fib* fib, uint32_t prefix, uint8_t plen,
+                            uint32_t nh)
+{
+    uint32_t i = 0, first = 0, count = 0, group = 0, entry = 0;
+
+    prefix &= SR_FIB_MASK(plen);
+
+    if(plen <= 24)
+    {
+        first = prefix >> 8;
+        count = 1 << (24 - plen);
+        for(i = 0; i < count; i++)
+        { fib->tbl24[first + i] = nh + 1; }
+        return;
+    }
+
+    /* -- longer than /24: push the slot out into an overflow group -- */
+    entry = fib->tbl24[prefix >> 8];
+    if(entry & SR_FIB_DIR_TBL8)
+    {
+        group = entry & ~SR_FIB_DIR_TBL8;
+    }
+    else
+    {
+        if(fib->n_tbl8 == fib->cap_tbl8)
+        {
+            fib->cap_tbl8 *= 2;
+            fib->tbl8 = (uint32_t*)realloc(fib->tbl8,
+                    fib->cap_tbl8 * 256 * sizeof(uint32_t));
+            assert(fib->tbl8);
+        }
+        group = fib->n_tbl8++;
+        for(i = 0; i < 256; i++)
+        { fib->tbl8[group * 256 + i] = entry; }
+        fib->tbl24[prefix >> 8] = SR_FIB_DIR_TBL8 | group;
+    }
+
+    first = group * 256 + (prefix & 0xff);
+    count = 1 << (32 - plen);
+    for(i = 0; i < count; i++)
+    { fib->tbl8[first + i] = nh + 1; }
+} /* -- sr_fib_dir_fill -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_dir_build(..)
+ * Scope:  Local
+ *
+ * Fill the DIR-24-8 tables from routes.  Routes are bucketed by prefix
+ * length so that shorter prefixes are painted first; within a bucket
+ * table order is kept so later lines still win.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_fib_dir_build(struct sr_fib* fib, struct sr_fib_route* routes,
+                             uint32_t n)
+{
+    uint32_t start[34];
+    uint32_t* order = 0;
+    uint32_t i = 0;
+    int len;
+
+    fib->tbl24 = (uint32_t*)calloc(SR_FIB_TBL24_SZ, sizeof(uint32_t));
+    fib->cap_tbl8 = SR_FIB_INIT_TBL8;
+    fib->tbl8 = (uint32_t*)malloc(fib->cap_tbl8 * 256 * sizeof(uint32_t));
+    order = (uint32_t*)malloc((n + 1) * sizeof(uint32_t));
+    assert(fib->tbl24 && fib->tbl8 && order);
+
+    /* -- counting sort of route indices by prefix length -- */
+    memset(start, 0, sizeof(start));
+    for(i = 0; i < n; i++)
+    { start[routes[i].plen + 1]++; }
+    for(len = 1; len < 34; len++)
+    { start[len] += start[len - 1]; }
+    for(i = 0; i < n; i++)
+    { order[start[routes[i].plen]++] = i; }
+
+    for(i = 0; i < n; i++)
+    {
+        sr_fib_dir_fill(fib, routes[order[i]].prefix, routes[order[i]].plen,
+                        routes[order[i]].nh);
+    }
+
+    free(order);
+} /* -- sr_fib_dir_build -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_nh_hash(..)
+ * Scope:  Local
+ *
+ * Hash of the n paths starting at paths, as used by the next hop index.
+ *
+ *---------------------------------------------------------------------*/
+
+static uint32_t sr_fib_nh_hash(const struct sr_nexthop* paths, uint32_t n)
+{
+    const char* ifname = 0;
+    uint32_t h = n;
+    uint32_t i = 0;
+
+    for(i = 0; i < n; i++)
+    {
+        h = (h ^ paths[i].gw) * 2654435761u;
+        for(ifname = paths[i].ifname; *ifname; ifname++)
+        { h = (h ^ (unsigned char)*ifname) * 16777619u; }
+    }
+
+    return h;
+} /* -- sr_fib_nh_hash -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_nh_equal(..)
+ * Scope:  Local
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_fib_nh_equal(const struct sr_nexthop* a,
+                           const struct sr_nexthop* b, uint32_t n)
+{
+    uint32_t i = 0;
+
+    for(i = 0; i < n; i++)
+    {
+        if(a[i].gw != b[i].gw ||
+           strncmp(a[i].ifname, b[i].ifname, sr_IFACE_NAMELEN))
+        { return 0; }
+    }
+
+    return 1;
+} /* -- sr_fib_nh_equal -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_add_group(..)
+ * Scope:  Global
+ *
+ * Return the index of the next hop records for the n_paths paths given,
+ * creating them if this is the first route to use exactly this set.  A
+ * single path is a plain next hop; more make a group of consecutive
+ * records.  slots is an open addressed index of existing records and
+ * groups (index + 1, 0 empty) with n_slots a power of two; it is grown
+ * here as needed.
+ *
+ *---------------------------------------------------------------------*/
+
+uint32_t sr_fib_add_group(struct sr_fib* fib, struct sr_fib_nh_index* index,
+                          const struct sr_nexthop* paths, uint32_t n_paths)
+{
+    struct sr_nexthop* nh = 0;
+    uint32_t h = 0, i = 0, slot = 0, first = 0;
+
+    assert(n_paths > 0 && n_paths <= SR_FIB_MAX_PATHS);
+
+    h = sr_fib_nh_hash(paths, n_paths) & (index->n_slots - 1);
+    while((slot = index->slots[h]) != 0)
+    {
+        nh = &(fib->nexthops[slot - 1]);
+        if(nh->n_paths == n_paths && sr_fib_nh_equal(nh, paths, n_paths))
+        { return slot - 1; }
+        h = (h + 1) & (index->n_slots - 1);
+    }
+
+    while(fib->n_nexthops + n_paths > fib->cap_nexthops)
+    {
+        fib->cap_nexthops *= 2;
+        fib->nexthops = (struct sr_nexthop*)realloc(fib->nexthops,
+                fib->cap_nexthops * sizeof(struct sr_nexthop));
+        assert(fib->nexthops);
+    }
+
+    first = fib->n_nexthops;
+    for(i = 0; i < n_paths; i++)
+    {
+        nh = &(fib->nexthops[first + i]);
+        memset(nh, 0, sizeof(struct sr_nexthop));
+        nh->gw = paths[i].gw;
+        strncpy(nh->ifname, paths[i].ifname, sr_IFACE_NAMELEN - 1);
+    }
+    fib->nexthops[first].n_paths = n_paths;
+    fib->n_nexthops += n_paths;
+    index->slots[h] = first + 1;
+
+    /* -- keep the index at most half full -- */
+    if(fib->n_nexthops * 2 > index->n_slots)
+    {
+        free(index->slots);
+        index->n_slots *= 2;
+        index->slots = (uint32_t*)calloc(index->n_slots, sizeof(uint32_t));
+        assert(index->slots);
+        for(i = 0; i < fib->n_nexthops; i += nh->n_paths)
+        {
+            nh = &(fib->nexthops[i]);
+            h = sr_fib_nh_hash(nh, nh->n_paths) & (index->n_slots - 1);
+            while(index->slots[h])
+            { h = (h + 1) & (index->n_slots - 1); }
+            index->slots[h] = i + 1;
+        }
+    }
+
+    return first;
+} /* -- sr_fib_add_group -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_add_nexthop(..)
+ * Scope:  Global
+ *
+ * Single path form of sr_fib_add_group.
+ *
+ *---------------------------------------------------------------------*/
+
+uint32_t sr_fib_add_nexthop(struct sr_fib* fib, struct sr_fib_nh_index* index,
+                            uint32_t gw, const char* ifname)
+{
+    struct sr_nexthop path;
+
+    path.gw = gw;
+    strncpy(path.ifname, ifname, sr_IFACE_NAMELEN - 1);
+    path.ifname[sr_IFACE_NAMELEN - 1] = 0;
+
+    return sr_fib_add_group(fib, index, &path, 1);
+} /* -- sr_fib_add_nexthop -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_new(..)
+ * Scope:  Local
+ *
+ *---------------------------------------------------------------------*/
+
+static struct sr_fib* sr_fib_new(int mode)
+{
+    struct sr_fib* fib = 0;
+
+    fib = (struct sr_fib*)calloc(1, sizeof(struct sr_fib));
+    assert(fib);
+    fib->mode = mode;
+    fib->generation = ++sr_fib_last_generation;
+
+    return fib;
+} /* -- sr_fib_new -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_alloc(..)
+ * Scope:  Global
+ *
+ * Allocate an empty FIB of the given mode along with a next hop index
+ * for sr_fib_add_nexthop.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_fib* sr_fib_alloc(int mode, struct sr_fib_nh_index* index)
+{
+    struct sr_fib* fib = 0;
+
+    fib = sr_fib_new(mode);
+
+    fib->cap_nexthops = SR_FIB_INIT_NH;
+    fib->nexthops = (struct sr_nexthop*)malloc(
+            fib->cap_nexthops * sizeof(struct sr_nexthop));
+    assert(fib->nexthops);
+
+    index->n_slots = 2 * SR_FIB_INIT_NH;
+    index->slots = (uint32_t*)calloc(index->n_slots, sizeof(uint32_t));
+    assert(index->slots);
+
+    return fib;
+} /* -- sr_fib_alloc -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_sort_routes(..)
+ * Scope:  Local
+ *
+ * Stable LSD radix sort of routes by prefix, 16 bits per pass.
+ * Inserting in address order keeps the trie path being extended hot in
+ * cache; stability keeps later duplicates winning.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_fib_sort_routes(struct sr_fib_route* routes, uint32_t n)
+{
+    struct sr_fib_route* tmp = 0;
+    struct sr_fib_route* src = routes;
+    struct sr_fib_route* dst = 0;
+    struct sr_fib_route* swap = 0;
+    uint32_t* count = 0;
+    uint32_t i = 0, key = 0, sum = 0, c = 0;
+    int shift;
+
+    tmp = (struct sr_fib_route*)malloc((n + 1) * sizeof(struct sr_fib_route));
+    count = (uint32_t*)malloc(65536 * sizeof(uint32_t));
+    assert(tmp && count);
+    dst = tmp;
+
+    for(shift = 0; shift < 32; shift += 16)
+    {
+        memset(count, 0, 65536 * sizeof(uint32_t));
+        for(i = 0; i < n; i++)
+        { count[(src[i].prefix >> shift) & 0xffff]++; }
+        for(key = 0, sum = 0; key < 65536; key++)
+        {
+            c = count[key];
+            count[key] = sum;
+            sum += c;
+        }
+        for(i = 0; i < n; i++)
+        { dst[count[(src[i].prefix >> shift) & 0xffff]++] = src[i]; }
+
+        swap = src;
+        src = dst;
+        dst = swap;
+    }
+
+    /* -- an even number of passes leaves the result back in routes -- */
+    free(tmp);
+    free(count);
+} /* -- sr_fib_sort_routes -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_build_routes(..)
+ * Scope:  Global
+ *
+ * Build the lookup structure of fib from n routes whose nh fields index
+ * fib->nexthops, then bind next hops to interfaces.  routes may be
+ * reordered.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_fib_build_routes(struct sr_instance* sr, struct sr_fib* fib,
+                         struct sr_fib_route* routes, uint32_t n)
+{
+    uint32_t i = 0;
+
+    fib->n_routes = n;
+
+    if(fib->mode == SR_FIB_DIR248)
+    {
+        sr_fib_dir_build(fib, routes, n);
+    }
+    else
+    {
+        fib->cap_nodes = SR_FIB_INIT_NODES;
+        fib->nodes = (struct sr_fib_node*)malloc(
+                fib->cap_nodes * sizeof(struct sr_fib_node));
+        assert(fib->nodes);
+
+        /* -- root covers 0.0.0.0/0 -- */
+        sr_fib_new_node(fib, 0, 0, SR_FIB_NO_NH);
+
+        /* -- duplicates must compare equal for the sort to keep them in order -- */
+        for(i = 0; i < n; i++)
+        { routes[i].prefix &= SR_FIB_MASK(routes[i].plen); }
+        sr_fib_sort_routes(routes, n);
+
+        for(i = 0; i < n; i++)
+        { sr_fib_insert(fib, routes[i].prefix, routes[i].plen, routes[i].nh); }
+    }
+
+    sr_fib_bind(sr, fib);
+} /* -- sr_fib_build_routes -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_bind(..)
+ * Scope:  Global
+ *
+ * Resolve the interface and source MAC of every next hop.  Called when
+ * the FIB is built and again once the server has told us about our
+ * interfaces.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_fib_bind(struct sr_instance* sr, struct sr_fib* fib)
+{
+    struct sr_nexthop* nh = 0;
+    uint32_t i = 0;
+
+    if(fib == 0)
+    { return; }
+
+    for(i = 0; i < fib->n_nexthops; i++)
+    {
+        nh = &(fib->nexthops[i]);
+        nh->iface = sr_get_interface(sr, nh->ifname);
+        nh->ifindex = nh->iface ? nh->iface->index : SR_IF_NONE;
+        if(nh->iface)
+        { memcpy(nh->mac, nh->iface->addr, ETHER_ADDR_LEN); }
+    }
+} /* -- sr_fib_bind -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_destroy(..)
+ * Scope:  Global
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_fib_destroy(struct sr_fib* fib)
+{
+    if(fib == 0)
+    { return; }
+
+    if(fib->image)
+    {
+        munmap(fib->image, fib->image_len);
+    }
+    else
+    {
+        free(fib->nodes);
+        free(fib->tbl24);
+        free(fib->tbl8);
+    }
+    free(fib->nexthops);
+    if(fib->rt_block)
+    { free(fib->routing_table); }
+    else
+    { sr_free_rt_list(fib->routing_table); }
+    free(fib);
+} /* -- sr_fib_destroy -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_image_section(..)
+ * Scope:  Local
+ *
+ * Write len bytes of data at the next SR_FIB_IMAGE_ALIGN boundary after
+ * *off, advancing *off past it.  Returns the section offset.
+ *
+ *---------------------------------------------------------------------*/
+
+static uint64_t sr_fib_image_section(FILE* fp, uint64_t* off,
+                                     const void* data, size_t len)
+{
+    static const char zeros[SR_FIB_IMAGE_ALIGN];
+    uint64_t pad = (SR_FIB_IMAGE_ALIGN - (*off % SR_FIB_IMAGE_ALIGN)) %
+                   SR_FIB_IMAGE_ALIGN;
+    uint64_t start = *off + pad;
+
+    fwrite(zeros, 1, pad, fp);
+    if(len)
+    { fwrite(data, 1, len, fp); }
+    *off = start + len;
+
+    return start;
+} /* -- sr_fib_image_section -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_write_image(..)
+ * Scope:  Global
+ *
+ * Write fib to filename as a binary image.  The image is written to a
+ * temporary file and renamed into place, so routers that have the old
+ * image mapped are not disturbed.  Returns 0 on success.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_fib_write_image(const struct sr_fib* fib, const char* filename)
+{
+    struct sr_fib_image_hdr hdr;
+    struct sr_fib_image_nh* nhs = 0;
+    char tmpname[BUFSIZ];
+    uint64_t off = 0;
+    uint32_t i = 0;
+    FILE* fp = 0;
+    int ok = 0;
+
+    assert(fib);
+    assert(filename);
+
+    snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+    if((fp = fopen(tmpname, "wb")) == 0)
+    {
+        perror("fopen");
+        return -1;
+    }
+
+    nhs = (struct sr_fib_image_nh*)calloc(fib->n_nexthops + 1,
+                                          sizeof(struct sr_fib_image_nh));
+    assert(nhs);
+    for(i = 0; i < fib->n_nexthops; i++)
+    {
+        nhs[i].gw = fib->nexthops[i].gw;
+        nhs[i].n_paths = fib->nexthops[i].n_paths;
+        memcpy(nhs[i].ifname, fib->nexthops[i].ifname, sr_IFACE_NAMELEN);
+    }
+
+    /* -- header goes first, rewritten once the offsets are known -- */
+    memset(&hdr, 0, sizeof(hdr));
+    fwrite(&hdr, 1, sizeof(hdr), fp);
+    off = sizeof(hdr);
+
+    memcpy(hdr.magic, SR_FIB_IMAGE_MAGIC, sizeof(hdr.magic));
+    hdr.version = SR_FIB_IMAGE_VERSION;
+    hdr.byte_order = SR_FIB_IMAGE_BOM;
+    hdr.mode = fib->mode;
+    hdr.n_routes = fib->n_routes;
+    hdr.n_nodes = fib->n_nodes;
+    hdr.n_tbl8 = fib->n_tbl8;
+    hdr.n_nexthops = fib->n_nexthops;
+    hdr.node_size = sizeof(struct sr_fib_node);
+    hdr.nodes_off = sr_fib_image_section(fp, &off, fib->nodes,
+            fib->n_nodes * sizeof(struct sr_fib_node));
+    hdr.tbl24_off = sr_fib_image_section(fp, &off, fib->tbl24,
+            fib->tbl24 ? SR_FIB_TBL24_SZ * sizeof(uint32_t) : 0);
+    hdr.tbl8_off = sr_fib_image_section(fp, &off, fib->tbl8,
+            fib->n_tbl8 * 256 * sizeof(uint32_t));
+    hdr.nexthops_off = sr_fib_image_section(fp, &off, nhs,
+            fib->n_nexthops * sizeof(struct sr_fib_image_nh));
+    hdr.size = off;
+
+    rewind(fp);
+    fwrite(&hdr, 1, sizeof(hdr), fp);
+    ok = !ferror(fp);
+    if(fclose(fp) != 0)
+    { ok = 0; }
+    free(nhs);
+
+    if(!ok || rename(tmpname, filename) != 0)
+    {
+        perror("sr_fib_write_image");
+        unlink(tmpname);
+        return -1;
+    }
+
+    return 0;
+} /* -- sr_fib_write_image -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_image_fits(..)
+ * Scope:  Local
+ *
+ * Return 1 if count elements of elem_size bytes at off lie inside an
+ * image of size bytes and off is on a section boundary, as written by
+ * sr_fib_image_section().  Never computes off + length, which a corrupt
+ * header could make wrap around.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_fib_image_fits(uint64_t size, uint64_t off, uint64_t count,
+                             uint64_t elem_size)
+{
+    return off % SR_FIB_IMAGE_ALIGN == 0 && off <= size &&
+           count <= (size - off) / elem_size;
+} /* -- sr_fib_image_fits -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_check_image(..)
+ * Scope:  Local
+ *
+ * Check every index the lookup paths follow in a mapped FIB: trie
+ * children and next hops, tbl24 groups and tbl8 next hops.  Children
+ * must have longer prefixes than their parent so a walk always ends.
+ * Returns 0 if the FIB is safe to look up in.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_fib_check_image(const struct sr_fib* fib)
+{
+    const struct sr_fib_node* node = 0;
+    uint32_t next = 0;
+    uint32_t i = 0;
+    uint64_t j = 0;
+    int k = 0;
+
+    for(i = 0; i < fib->n_nodes; i++)
+    {
+        node = &(fib->nodes[i]);
+        if(node->plen > 32 ||
+           (node->nh != SR_FIB_NO_NH && node->nh >= fib->n_nexthops))
+        { return -1; }
+        for(k = 0; k < 2; k++)
+        {
+            next = node->child[k];
+            if(next == 0)
+            { continue; }
+            if(next >= fib->n_nodes || fib->nodes[next].plen <= node->plen)
+            { return -1; }
+        }
+    }
+
+    if(fib->tbl24)
+    {
+        for(i = 0; i < SR_FIB_TBL24_SZ; i++)
+        {
+            next = fib->tbl24[i];
+            if(next & SR_FIB_DIR_TBL8)
+            {
+                if((next & ~SR_FIB_DIR_TBL8) >= fib->n_tbl8)
+                { return -1; }
+            }
+            else if(next > fib->n_nexthops)
+            { return -1; }
+        }
+    }
+
+    for(j = 0; j < (uint64_t)fib->n_tbl8 * 256; j++)
+    {
+        if(fib->tbl8[j] > fib->n_nexthops)
+        { return -1; }
+    }
+
+    return 0;
+} /* -- sr_fib_check_image -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_map_image(..)
+ * Scope:  Global
+ *
+ * Map a binary image written by sr_fib_write_image() and return a FIB
+ * that serves lookups straight from the mapping.  Only the next hop
+ * records are copied, since they carry per process interface pointers.
+ * The image has no route list.  Returns 0 if the image is unusable.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_fib* sr_fib_map_image(struct sr_instance* sr, const char* filename)
+{
+    const struct sr_fib_image_hdr* hdr = 0;
+    const struct sr_fib_image_nh* nhs = 0;
+    struct sr_fib* fib = 0;
+    struct stat st;
+    uint8_t* base = 0;
+    uint64_t tbl24_len = 0;
+    uint32_t i = 0;
+    int fd;
+
+    if((fd = open(filename, O_RDONLY)) < 0 || fstat(fd, &st) != 0)
+    {
+        perror("open");
+        if(fd >= 0)
+        { close(fd); }
+        return 0;
+    }
+    if(st.st_size < (off_t)sizeof(struct sr_fib_image_hdr))
+    {
+        fprintf(stderr, "FIB image %s is truncated\n", filename);
+        close(fd);
+        return 0;
+    }
+
+    base = (uint8_t*)mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(base == (uint8_t*)MAP_FAILED)
+    {
+        perror("mmap");
+        return 0;
+    }
+
+    /* -- sanity check the header before trusting any offset -- */
+    hdr = (const struct sr_fib_image_hdr*)base;
+    tbl24_len = (hdr->mode == SR_FIB_DIR248) ? SR_FIB_TBL24_SZ * sizeof(uint32_t) : 0;
+    if(memcmp(hdr->magic, SR_FIB_IMAGE_MAGIC, sizeof(hdr->magic)) != 0 ||
+       hdr->version != SR_FIB_IMAGE_VERSION ||
+       hdr->byte_order != SR_FIB_IMAGE_BOM ||
+       hdr->node_size != sizeof(struct sr_fib_node) ||
+       (hdr->mode != SR_FIB_TRIE && hdr->mode != SR_FIB_DIR248) ||
+       (hdr->mode == SR_FIB_TRIE && hdr->n_nodes == 0) ||
+       hdr->size != (uint64_t)st.st_size ||
+       hdr->n_tbl8 >= SR_FIB_DIR_TBL8 ||
+       !sr_fib_image_fits(hdr->size, hdr->nodes_off, hdr->n_nodes,
+                          sizeof(struct sr_fib_node)) ||
+       !sr_fib_image_fits(hdr->size, hdr->tbl24_off, tbl24_len, 1) ||
+       !sr_fib_image_fits(hdr->size, hdr->tbl8_off, hdr->n_tbl8,
+                          256 * sizeof(uint32_t)) ||
+       !sr_fib_image_fits(hdr->size, hdr->nexthops_off, hdr->n_nexthops,
+                          sizeof(struct sr_fib_image_nh)))
+    {
+        fprintf(stderr, "FIB image %s is corrupt or from another build\n",
+                filename);
+        munmap(base, st.st_size);
+        return 0;
+    }
+
+    fib = sr_fib_new(hdr->mode);
+    fib->image = base;
+    fib->image_len = st.st_size;
+    fib->n_routes = hdr->n_routes;
+    fib->nodes = (struct sr_fib_node*)(base + hdr->nodes_off);
+    fib->n_nodes = hdr->n_nodes;
+    fib->tbl24 = tbl24_len ? (uint32_t*)(base + hdr->tbl24_off) : 0;
+    fib->tbl8 = (uint32_t*)(base + hdr->tbl8_off);
+    fib->n_tbl8 = hdr->n_tbl8;
+
+    fib->n_nexthops = fib->cap_nexthops = hdr->n_nexthops;
+    fib->nexthops = (struct sr_nexthop*)calloc(fib->n_nexthops + 1,
+                                               sizeof(struct sr_nexthop));
+    assert(fib->nexthops);
+    nhs = (const struct sr_fib_image_nh*)(base + hdr->nexthops_off);
+    for(i = 0; i < fib->n_nexthops; i++)
+    {
+        fib->nexthops[i].gw = nhs[i].gw;
+        fib->nexthops[i].n_paths = nhs[i].n_paths;
+        memcpy(fib->nexthops[i].ifname, nhs[i].ifname, sr_IFACE_NAMELEN);
+        fib->nexthops[i].ifname[sr_IFACE_NAMELEN - 1] = 0;
+    }
+
+    /* -- the header only bounds the sections, check what is in them -- */
+    if(sr_fib_check_image(fib) != 0)
+    {
+        fprintf(stderr, "FIB image %s has bad node or table entries\n", filename);
+        sr_fib_destroy(fib);
+        return 0;
+    }
+
+    /* -- groups must not run off the end, sr_fib_select_path trusts them -- */
+    for(i = 0; i < fib->n_nexthops; i += fib->nexthops[i].n_paths)
+    {
+        if(fib->nexthops[i].n_paths == 0 ||
+           fib->nexthops[i].n_paths > SR_FIB_MAX_PATHS ||
+           fib->nexthops[i].n_paths > fib->n_nexthops - i)
+        {
+            fprintf(stderr, "FIB image %s has bad next hop groups\n", filename);
+            sr_fib_destroy(fib);
+            return 0;
+        }
+    }
+
+    sr_fib_bind(sr, fib);
+
+    return fib;
+} /* -- sr_fib_map_image -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_rcu_init(..)
+ * Scope:  Global
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_fib_rcu_init(struct sr_fib_rcu* rcu)
+{
+    rcu->current = 0;
+    rcu->epoch = 0;
+    rcu->readers[0] = 0;
+    rcu->readers[1] = 0;
+    pthread_mutex_init(&(rcu->update_lock), 0);
+} /* -- sr_fib_rcu_init -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_read_lock(..)
+ * Scope:  Global
+ *
+ * Enter a read side section.  The FIB returned by sr_fib_current()
+ * and anything pointing into it (next hop records) stays valid until
+ * the matching sr_fib_read_unlock().  Sections may nest.  Returns the
+ * slot to hand back to sr_fib_read_unlock().
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_fib_read_lock(struct sr_fib_rcu* rcu)
+{
+    uint32_t epoch = 0;
+    int slot = 0;
+
+    while(1)
+    {
+        epoch = rcu->epoch;
+        slot = epoch & 1;
+        __sync_fetch_and_add(&(rcu->readers[slot]), 1);
+
+        /* -- a publisher flipped the epoch under us: count again -- */
+        if(rcu->epoch == epoch)
+        { return slot; }
+        __sync_fetch_and_sub(&(rcu->readers[slot]), 1);
+    }
+} /* -- sr_fib_read_lock -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_read_unlock(..)
+ * Scope:  Global
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_fib_read_unlock(struct sr_fib_rcu* rcu, int slot)
+{
+    __sync_fetch_and_sub(&(rcu->readers[slot]), 1);
+} /* -- sr_fib_read_unlock -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_publish(..)
+ * Scope:  Global
+ *
+ * Make fib the live FIB and free the previous one once no reader can
+ * still be using it.  Must not be called from inside a read section.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_fib_publish(struct sr_instance* sr, struct sr_fib* fib)
+{
+    struct sr_fib_rcu* rcu = &(sr->fib_rcu);
+    struct sr_fib* old = 0;
+    uint32_t epoch = 0;
+
+    pthread_mutex_lock(&(rcu->update_lock));
+
+    old = rcu->current;
+    __sync_synchronize();
+    rcu->current = fib;
+    sr->routing_table = fib ? fib->routing_table : 0;
+    __sync_synchronize();
+
+    /* -- new readers count in the other slot; wait out the old one -- */
+    epoch = rcu->epoch;
+    rcu->epoch = epoch + 1;
+    __sync_synchronize();
+    while(rcu->readers[epoch & 1] != 0)
+    { usleep(100); }
+
+    pthread_mutex_unlock(&(rcu->update_lock));
+
+    sr_fib_destroy(old);
+} /* -- sr_fib_publish -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_lookup(..)
+ * Scope:  Global
+ *
+ * Longest prefix match for ip (network byte order).  Returns the next
+ * hop of the matching route or 0 if nothing matches.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_nexthop* sr_fib_lookup(const struct sr_fib* fib, uint32_t ip_nbo)
+{
+    const struct sr_fib_node* node = 0;
+    uint32_t addr = ntohl(ip_nbo);
+    uint32_t best = SR_FIB_NO_NH;
+    uint32_t next = 0;
+
+    if(fib == 0)
+    { return 0; }
+
+    if(fib->mode == SR_FIB_DIR248)
+    {
+        next = fib->tbl24[addr >> 8];
+        if(next & SR_FIB_DIR_TBL8)
+        { next = fib->tbl8[(next & ~SR_FIB_DIR_TBL8) * 256 + (addr & 0xff)]; }
+        return next ? &(fib->nexthops[next - 1]) : 0;
+    }
+
+    node = &(fib->nodes[0]);
+    while(1)
+    {
+        /* -- compressed path: check the bits we skipped over -- */
+        if((addr ^ node->key) & SR_FIB_MASK(node->plen))
+        { break; }
+
+        if(node->nh != SR_FIB_NO_NH)
+        { best = node->nh; }
+
+        if(node->plen == 32)
+        { break; }
+
+        next = node->child[SR_FIB_BIT(addr, node->plen)];
+        if(next == 0)
+        { break; }
+        node = &(fib->nodes[next]);
+    }
+
+    return (best == SR_FIB_NO_NH) ? 0 : &(fib->nexthops[best]);
+} /* -- sr_fib_lookup -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_lookup_burst(..)
+ * Scope:  Global
+ *
+ * sr_fib_lookup() for n addresses at once, results in nhs.  Up to
+ * SR_FIB_BURST lookups are walked in lockstep, one level per round,
+ * prefetching each one's next node (or table entry) before moving on to
+ * the others, so their cache misses overlap instead of being taken one
+ * after the other.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_fib_lookup_burst(const struct sr_fib* fib, const uint32_t* ips_nbo,
+                         struct sr_nexthop** nhs, uint32_t n)
+{
+    const struct sr_fib_node* node = 0;
+    uint32_t addr[SR_FIB_BURST];
+    uint32_t cur[SR_FIB_BURST];
+    uint32_t best[SR_FIB_BURST];
+    uint32_t active[SR_FIB_BURST];
+    uint32_t base = 0, m = 0, i = 0, j = 0, n_active = 0, next = 0;
+
+    if(fib == 0)
+    {
+        for(i = 0; i < n; i++)
+        { nhs[i] = 0; }
+        return;
+    }
+
+    for(base = 0; base < n; base += m)
+    {
+        m = (n - base < SR_FIB_BURST) ? n - base : SR_FIB_BURST;
+
+        for(i = 0; i < m; i++)
+        { addr[i] = ntohl(ips_nbo[base + i]); }
+
+        if(fib->mode == SR_FIB_DIR248)
+        {
+            for(i = 0; i < m; i++)
+            { __builtin_prefetch(&(fib->tbl24[addr[i] >> 8])); }
+            for(i = 0; i < m; i++)
+            {
+                cur[i] = fib->tbl24[addr[i] >> 8];
+                if(cur[i] & SR_FIB_DIR_TBL8)
+                {
+                    cur[i] = (cur[i] & ~SR_FIB_DIR_TBL8) * 256 + (addr[i] & 0xff);
+                    __builtin_prefetch(&(fib->tbl8[cur[i]]));
+                    cur[i] |= SR_FIB_DIR_TBL8;
+                }
+            }
+            for(i = 0; i < m; i++)
+            {
+                next = cur[i];
+                if(next & SR_FIB_DIR_TBL8)
+                { next = fib->tbl8[next & ~SR_FIB_DIR_TBL8]; }
+                nhs[base + i] = next ? &(fib->nexthops[next - 1]) : 0;
+            }
+            continue;
+        }
+
+        for(i = 0; i < m; i++)
+        {
+            cur[i] = 0;
+            best[i] = SR_FIB_NO_NH;
+            active[i] = i;
+        }
+
+        /* -- one trie level per round for every walk still going -- */
+        for(n_active = m; n_active; n_active = j)
+        {
+            for(i = 0, j = 0; i < n_active; i++)
+            {
+                uint32_t k = active[i];
+
+                node = &(fib->nodes[cur[k]]);
+                if((addr[k] ^ node->key) & SR_FIB_MASK(node->plen))
+                { continue; }
+                if(node->nh != SR_FIB_NO_NH)
+                { best[k] = node->nh; }
+                if(node->plen == 32)
+                { continue; }
+                next = node->child[SR_FIB_BIT(addr[k], node->plen)];
+                if(next == 0)
+                { continue; }
+
+                __builtin_prefetch(&(fib->nodes[next]));
+                cur[k] = next;
+                active[j++] = k;
+            }
+        }
+
+        for(i = 0; i < m; i++)
+        {
+            nhs[base + i] = (best[i] == SR_FIB_NO_NH) ? 0 :
+                            &(fib->nexthops[best[i]]);
+        }
+    }
+} /* -- sr_fib_lookup_burst -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_select_path(..)
+ * Scope:  Global
+ *
+ * Pick the path of nh to use for a flow.  Plain next hops are returned
+ * as they are; for an ECMP group the flow hash picks one member, so all
+ * packets of a flow leave by the same path.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_nexthop* sr_fib_select_path(struct sr_nexthop* nh, uint32_t flow_hash)
+{
+    if(nh == 0 || nh->n_paths <= 1)
+    { return nh; }
+
+    return nh + (flow_hash % nh->n_paths);
+} /* -- sr_fib_select_path -- */
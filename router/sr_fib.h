@@ -0,0 +1,212 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_fib.h
+ *
+ * Description:
+ *
+ * Forwarding information base built from the routing table.  Routes are
+ * stored in a path-compressed binary (Patricia) trie kept in a flat node
+ * array, so a lookup visits at most 33 nodes and always returns the
+ * longest matching prefix.
+ *
+ * Alternatively the FIB can be built as a DIR-24-8 table: a 2^24 entry
+ * array indexed by the top 24 bits of the destination, with 256 entry
+ * overflow groups for prefixes longer than /24.  This costs 64MB but
+ * resolves most destinations with a single memory access.
+ *
+ * A built FIB can be written out as a binary image (sr_fib_write_image)
+ * and later mapped read-only (sr_fib_map_image).  Nodes and tables only
+ * refer to each other by index, so lookups run directly out of the
+ * mapping and several routers can share it through the page cache.
+ *
+ * The live FIB is published through struct sr_fib_rcu.  Readers bracket
+ * their use of it with sr_fib_read_lock/unlock, which never block; a
+ * new FIB is swapped in with sr_fib_publish, which waits until every
+ * reader that might still see the old one has left before freeing it.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef sr_FIB_H
+#define sr_FIB_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif /* _DARWIN_ */
+
+#include <pthread.h>
+
+#include "sr_if.h"
+
+struct sr_instance;
+struct sr_rt;
+
+#define SR_FIB_NO_NH 0xffffffff
+
+/* lookup structure to build */
+#define SR_FIB_TRIE   0
+#define SR_FIB_DIR248 1
+
+/* DIR-24-8 entries hold next hop index + 1 (0 means no route), or the index
+   of an overflow group when SR_FIB_DIR_TBL8 is set */
+#define SR_FIB_DIR_TBL8 0x80000000
+
+/* lookups sr_fib_lookup_burst keeps in flight at once */
+#define SR_FIB_BURST 16
+
+/* most equal cost paths one route may have */
+#define SR_FIB_MAX_PATHS 16
+
+/* binary image layout, see sr_fib_write_image() */
+#define SR_FIB_IMAGE_MAGIC   "SRFIBIMG"
+#define SR_FIB_IMAGE_VERSION 2
+#define SR_FIB_IMAGE_ALIGN   64
+#define SR_FIB_IMAGE_BOM     0x01020304 /* byte order check */
+
+struct sr_fib_image_hdr
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t mode;
+    uint32_t n_routes;
+    uint32_t n_nodes;
+    uint32_t n_tbl8;
+    uint32_t n_nexthops;
+    uint32_t node_size;                 /* sizeof(struct sr_fib_node) */
+    uint64_t nodes_off;                 /* offsets from start of file */
+    uint64_t tbl24_off;
+    uint64_t tbl8_off;
+    uint64_t nexthops_off;
+    uint64_t size;                      /* total file size */
+};
+
+struct sr_fib_image_nh
+{
+    uint32_t gw;
+    uint32_t n_paths;
+    char     ifname[sr_IFACE_NAMELEN];
+};
+
+/* ----------------------------------------------------------------------------
+ * struct sr_nexthop
+ *
+ * Result of a route lookup.  Routes sharing a gateway and interface share
+ * one record.  iface and mac are filled in once the interface list is
+ * known (see sr_fib_bind) and are 0 before that.
+ *
+ * An equal cost multipath route resolves to the first of n_paths
+ * consecutive records; the ones after it have n_paths 0.  Pick one per
+ * flow with sr_fib_select_path.
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_nexthop
+{
+    uint32_t gw;                        /* gateway, nbo, 0 if on-link */
+    struct sr_if* iface;                /* outgoing interface */
+    unsigned char mac[ETHER_ADDR_LEN];  /* source MAC for iface */
+    char ifname[sr_IFACE_NAMELEN];
+    int ifindex;                        /* iface->index, or SR_IF_NONE */
+    uint32_t n_paths;                   /* 1, >1 for an ECMP group, or 0 */
+};
+
+/* address to ARP for when forwarding to dst through nh */
+#define SR_NEXTHOP_IP(nh, dst) ((nh)->gw ? (nh)->gw : (dst))
+
+/* ----------------------------------------------------------------------------
+ * struct sr_fib_node
+ *
+ * Trie node.  key holds the first plen bits of the prefix in host byte
+ * order.  Child indices of 0 mean "no child" since the root (index 0) is
+ * never anyone's child.
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_fib_node
+{
+    uint32_t key;
+    uint32_t child[2];
+    uint32_t nh;                /* index into fib->nexthops or SR_FIB_NO_NH */
+    uint8_t  plen;
+};
+
+struct sr_fib
+{
+    int mode;                   /* SR_FIB_TRIE or SR_FIB_DIR248 */
+    uint32_t generation;        /* unique per build, tags cached lookups */
+    struct sr_fib_node* nodes;
+    uint32_t n_nodes;
+    uint32_t cap_nodes;
+    uint32_t* tbl24;            /* DIR-24-8 first level, 1 << 24 entries */
+    uint32_t* tbl8;             /* DIR-24-8 overflow groups of 256 */
+    uint32_t n_tbl8;
+    uint32_t cap_tbl8;
+    struct sr_nexthop* nexthops;
+    uint32_t n_nexthops;
+    uint32_t cap_nexthops;
+    uint32_t n_routes;
+    struct sr_rt* routing_table; /* list built from, freed with the FIB */
+    int rt_block;               /* list is one allocation, not per node */
+    void* image;                /* mapping nodes/tables live in, if any */
+    size_t image_len;
+};
+
+/* route as fed to the trie/table builders, prefix in host byte order */
+struct sr_fib_route
+{
+    uint32_t prefix;
+    uint32_t nh;
+    uint8_t  plen;
+};
+
+/* open addressed index over fib->nexthops used while building */
+struct sr_fib_nh_index
+{
+    uint32_t* slots;
+    uint32_t n_slots;
+};
+
+/* ----------------------------------------------------------------------------
+ * struct sr_fib_rcu
+ *
+ * Epoch based publication of the live FIB.  Readers count themselves in
+ * the slot matching the epoch parity they entered under.  Publishing
+ * bumps the epoch and waits for the old slot to drain.
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_fib_rcu
+{
+    struct sr_fib* volatile current;
+    volatile uint32_t epoch;
+    volatile int readers[2];
+    pthread_mutex_t update_lock;        /* serializes publishers */
+};
+
+#define sr_fib_current(rcu) ((rcu)->current)
+
+struct sr_fib* sr_fib_alloc(int mode, struct sr_fib_nh_index* index);
+uint32_t sr_fib_add_nexthop(struct sr_fib* fib, struct sr_fib_nh_index* index,
+                            uint32_t gw, const char* ifname);
+uint32_t sr_fib_add_group(struct sr_fib* fib, struct sr_fib_nh_index* index,
+                          const struct sr_nexthop* paths, uint32_t n_paths);
+void sr_fib_build_routes(struct sr_instance* sr, struct sr_fib* fib,
+                         struct sr_fib_route* routes, uint32_t n);
+uint8_t sr_fib_mask_len(uint32_t mask_nbo);
+void sr_fib_bind(struct sr_instance* sr, struct sr_fib* fib);
+int  sr_fib_write_image(const struct sr_fib* fib, const char* filename);
+struct sr_fib* sr_fib_map_image(struct sr_instance* sr, const char* filename);
+void sr_fib_destroy(struct sr_fib* fib);
+void sr_fib_rcu_init(struct sr_fib_rcu* rcu);
+int  sr_fib_read_lock(struct sr_fib_rcu* rcu);
+void sr_fib_read_unlock(struct sr_fib_rcu* rcu, int slot);
+void sr_fib_publish(struct sr_instance* sr, struct sr_fib* fib);
+struct sr_nexthop* sr_fib_lookup(const struct sr_fib* fib, uint32_t ip_nbo);
+void sr_fib_lookup_burst(const struct sr_fib* fib, const uint32_t* ips_nbo,
+                         struct sr_nexthop** nhs, uint32_t n);
+struct sr_nexthop* sr_fib_select_path(struct sr_nexthop* nh, uint32_t flow_hash);
+
+#endif  /* --  sr_FIB_H -- */
@@ -0,0 +1,225 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_fib_bench.c
+ *
+ * Description:
+ *
+ * Microbenchmark of route lookups: sr_longest_prefix_nexthop() one
+ * destination at a time against sr_longest_prefix_nexthops() in bursts,
+ * over a generated table, in both trie and DIR-24-8 mode.  Every burst
+ * result is checked against the single lookup for the same address.
+ *
+ *   sr_fib_bench [routes [lookups]]
+ *
+ * Built and run by "make bench".
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+#include "sr_router.h"
+#include "sr_rt.h"
+#include "sr_fib.h"
+
+#define BENCH_ROUTES   500000
+#define BENCH_LOOKUPS  2000000
+#define BENCH_BURST    32
+#define BENCH_NEXTHOPS 64
+
+/*---------------------------------------------------------------------
+ * Method: sr_get_interface(..)
+ * Scope:  Global
+ *
+ * The bench has no interfaces; sr_fib_bind() leaves next hops unbound.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_if* sr_get_interface(struct sr_instance* sr, const char* name)
+{
+    return 0;
+} /* -- sr_get_interface -- */
+
+static uint32_t bench_rand32(void)
+{
+    return ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+} /* -- bench_rand32 -- */
+
+/*---------------------------------------------------------------------
+ * Method: bench_plen(..)
+ * Scope:  Local
+ *
+ * Prefix length with roughly the spread of an Internet table: mostly
+ * /24, a good share of /16-/23, a few shorter and longer ones.
+ *
+ *---------------------------------------------------------------------*/
+
+static uint8_t bench_plen(void)
+{
+    int r = rand() % 100;
+
+    if(r < 55)
+    { return 24; }
+    if(r < 85)
+    { return 16 + rand() % 8; }
+    if(r < 90)
+    { return 8 + rand() % 8; }
+    return 25 + rand() % 8;
+} /* -- bench_plen -- */
+
+static double bench_now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+} /* -- bench_now -- */
+
+/*---------------------------------------------------------------------
+ * Method: bench_build(..)
+ * Scope:  Local
+ *
+ * Build a FIB of the given mode over n generated routes plus a default
+ * route and publish it in sr.  Same seed for every mode, so both modes
+ * see the same table.
+ *
+ *---------------------------------------------------------------------*/
+
+static void bench_build(struct sr_instance* sr, int mode, uint32_t n)
+{
+    struct sr_fib* fib = 0;
+    struct sr_fib_nh_index index;
+    struct sr_fib_route* routes = 0;
+    char ifname[sr_IFACE_NAMELEN];
+    uint32_t nh[BENCH_NEXTHOPS];
+    uint32_t i = 0;
+
+    srand(1);
+    fib = sr_fib_alloc(mode, &index);
+    for(i = 0; i < BENCH_NEXTHOPS; i++)
+    {
+        snprintf(ifname, sizeof(ifname), "eth%u", i % 4);
+        nh[i] = sr_fib_add_nexthop(fib, &index, htonl(0x0a000001 + i), ifname);
+    }
+
+    routes = (struct sr_fib_route*)malloc((n + 1) * sizeof(struct sr_fib_route));
+    if(routes == 0)
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    for(i = 0; i < n; i++)
+    {
+        routes[i].plen = bench_plen();
+        routes[i].prefix = bench_rand32();
+        routes[i].nh = nh[rand() % BENCH_NEXTHOPS];
+    }
+    routes[n].prefix = 0;
+    routes[n].plen = 0;
+    routes[n].nh = nh[0];
+
+    sr_fib_build_routes(sr, fib, routes, n + 1);
+    sr_fib_publish(sr, fib);
+
+    free(routes);
+    free(index.slots);
+} /* -- bench_build -- */
+
+/*---------------------------------------------------------------------
+ * Method: bench_run(..)
+ * Scope:  Local
+ *
+ * Time the single and burst lookups over ips and compare the results.
+ * Returns the number of addresses the two disagreed on.
+ *
+ *---------------------------------------------------------------------*/
+
+static uint32_t bench_run(struct sr_instance* sr, const char* name,
+                          const uint32_t* ips, uint32_t n)
+{
+    struct sr_nexthop** single = 0;
+    struct sr_nexthop** burst = 0;
+    double t0 = 0, t1 = 0, t2 = 0;
+    uint32_t i = 0, bad = 0;
+    int k = 0;
+
+    single = (struct sr_nexthop**)malloc(n * sizeof(struct sr_nexthop*));
+    burst = (struct sr_nexthop**)malloc(n * sizeof(struct sr_nexthop*));
+    if(single == 0 || burst == 0)
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    t0 = bench_now();
+    for(i = 0; i < n; i++)
+    { single[i] = sr_longest_prefix_nexthop(sr, ips[i]); }
+    t1 = bench_now();
+    for(i = 0; i < n; i += BENCH_BURST)
+    {
+        k = (n - i < BENCH_BURST) ? (int)(n - i) : BENCH_BURST;
+        sr_longest_prefix_nexthops(sr, ips + i, burst + i, k);
+    }
+    t2 = bench_now();
+
+    for(i = 0; i < n; i++)
+    {
+        if(single[i] != burst[i])
+        { bad++; }
+    }
+
+    printf("%-8s single %7.1f ns/lookup   burst of %d %7.1f ns/lookup   "
+           "%u mismatches\n", name,
+           (t1 - t0) * 1e9 / n, BENCH_BURST, (t2 - t1) * 1e9 / n, bad);
+
+    free(single);
+    free(burst);
+    return bad;
+} /* -- bench_run -- */
+
+int main(int argc, char** argv)
+{
+    static struct sr_instance sr;
+    uint32_t n_routes = BENCH_ROUTES;
+    uint32_t n_lookups = BENCH_LOOKUPS;
+    uint32_t* ips = 0;
+    uint32_t i = 0, bad = 0;
+
+    if(argc > 1)
+    { n_routes = strtoul(argv[1], 0, 10); }
+    if(argc > 2)
+    { n_lookups = strtoul(argv[2], 0, 10); }
+    if(n_lookups == 0)
+    {
+        fprintf(stderr, "usage: %s [routes [lookups]]\n", argv[0]);
+        return 1;
+    }
+
+    sr_fib_rcu_init(&(sr.fib_rcu));
+
+    /* -- random destinations, so most lookups miss the cache -- */
+    srand(2);
+    ips = (uint32_t*)malloc(n_lookups * sizeof(uint32_t));
+    if(ips == 0)
+    {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    for(i = 0; i < n_lookups; i++)
+    { ips[i] = htonl(bench_rand32()); }
+
+    printf("%u routes, %u lookups\n", n_routes, n_lookups);
+
+    bench_build(&sr, SR_FIB_TRIE, n_routes);
+    bad += bench_run(&sr, "trie", ips, n_lookups);
+
+    bench_build(&sr, SR_FIB_DIR248, n_routes);
+    bad += bench_run(&sr, "dir-24-8", ips, n_lookups);
+
+    sr_fib_publish(&sr, 0);
+    free(ips);
+
+    return bad ? 1 : 0;
+} /* -- main -- */
@@ -0,0 +1,294 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_fib_test.c
+ *
+ * Description:
+ *
+ * Checks that sr_fib_map_image() maps a good FIB image in both modes and
+ * answers lookups the same as the FIB it was written from, and that it
+ * rejects corrupt images: header offsets that wrap around or are not on
+ * a section boundary, sections past the end of the file, a truncated
+ * file, and node or table entries pointing out of range.
+ *
+ * Built and run by "make test".
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+
+#include "sr_router.h"
+#include "sr_rt.h"
+#include "sr_fib.h"
+
+#define TEST_ROUTES  2000
+#define TEST_LOOKUPS 100000
+
+static int failures = 0;
+static char image[] = "/tmp/sr_fib_test.XXXXXX";
+
+/*---------------------------------------------------------------------
+ * Method: sr_get_interface(..)
+ * Scope:  Global
+ *
+ * The test has no interfaces; sr_fib_bind() leaves next hops unbound.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_if* sr_get_interface(struct sr_instance* sr, const char* name)
+{
+    return 0;
+} /* -- sr_get_interface -- */
+
+static uint32_t test_rand32(void)
+{
+    return ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+} /* -- test_rand32 -- */
+
+static void test_check(int ok, const char* what, int mode)
+{
+    if(!ok)
+    {
+        fprintf(stderr, "FAIL: %s (mode %d)\n", what, mode);
+        failures++;
+    }
+} /* -- test_check -- */
+
+/*---------------------------------------------------------------------
+ * Method: test_build(..)
+ * Scope:  Local
+ *
+ * FIB of the given mode over TEST_ROUTES random routes.
+ *
+ *---------------------------------------------------------------------*/
+
+static struct sr_fib* test_build(struct sr_instance* sr, int mode)
+{
+    struct sr_fib* fib = 0;
+    struct sr_fib_nh_index index;
+    struct sr_fib_route routes[TEST_ROUTES];
+    uint32_t i = 0;
+
+    srand(1);
+    fib = sr_fib_alloc(mode, &index);
+    for(i = 0; i < TEST_ROUTES; i++)
+    {
+        routes[i].plen = 8 + rand() % 25;
+        routes[i].prefix = test_rand32();
+        routes[i].nh = sr_fib_add_nexthop(fib, &index, htonl(i % 50 + 1),
+                                          "eth1");
+    }
+    sr_fib_build_routes(sr, fib, routes, TEST_ROUTES);
+    free(index.slots);
+
+    return fib;
+} /* -- test_build -- */
+
+static void test_read_hdr(struct sr_fib_image_hdr* hdr)
+{
+    int fd = open(image, O_RDONLY);
+
+    if(fd < 0 || pread(fd, hdr, sizeof(*hdr), 0) != sizeof(*hdr))
+    { perror("read image header"); exit(1); }
+    close(fd);
+} /* -- test_read_hdr -- */
+
+static void test_write(off_t off, const void* data, size_t len)
+{
+    int fd = open(image, O_WRONLY);
+
+    if(fd < 0 || pwrite(fd, data, len, off) != (ssize_t)len)
+    { perror("write image"); exit(1); }
+    close(fd);
+} /* -- test_write -- */
+
+/*---------------------------------------------------------------------
+ * Method: test_reject(..)
+ * Scope:  Local
+ *
+ * Rewrite the image from fib, let corrupt() damage it and check that it
+ * no longer maps.
+ *
+ *---------------------------------------------------------------------*/
+
+static void test_reject(struct sr_instance* sr, struct sr_fib* fib,
+                        void (*corrupt)(struct sr_fib_image_hdr*),
+                        const char* what)
+{
+    struct sr_fib_image_hdr hdr;
+    struct sr_fib* mapped = 0;
+
+    if(sr_fib_write_image(fib, image) != 0)
+    { fprintf(stderr, "cannot write %s\n", image); exit(1); }
+    test_read_hdr(&hdr);
+    corrupt(&hdr);
+
+    mapped = sr_fib_map_image(sr, image);
+    test_check(mapped == 0, what, fib->mode);
+    sr_fib_destroy(mapped);
+} /* -- test_reject -- */
+
+/* -- header damage -- */
+
+static void wrap_nodes_off(struct sr_fib_image_hdr* hdr)
+{
+    hdr->nodes_off = (uint64_t)0 - (uint64_t)hdr->n_nodes *
+                     sizeof(struct sr_fib_node) + 64;
+    test_write(0, hdr, sizeof(*hdr));
+}
+
+static void wrap_tbl8_off(struct sr_fib_image_hdr* hdr)
+{
+    hdr->tbl8_off = (uint64_t)0 - (uint64_t)hdr->n_tbl8 * 1024 + 64;
+    test_write(0, hdr, sizeof(*hdr));
+}
+
+static void huge_nexthops(struct sr_fib_image_hdr* hdr)
+{
+    hdr->n_nexthops = 0xffffffff;
+    test_write(0, hdr, sizeof(*hdr));
+}
+
+static void unaligned_nodes(struct sr_fib_image_hdr* hdr)
+{
+    hdr->nodes_off += 4;
+    test_write(0, hdr, sizeof(*hdr));
+}
+
+static void unaligned_nexthops(struct sr_fib_image_hdr* hdr)
+{
+    hdr->nexthops_off += 2;
+    test_write(0, hdr, sizeof(*hdr));
+}
+
+static void truncated(struct sr_fib_image_hdr* hdr)
+{
+    if(truncate(image, hdr->size - 8) != 0)
+    { perror("truncate"); exit(1); }
+}
+
+/* -- section damage -- */
+
+static void bad_child(struct sr_fib_image_hdr* hdr)
+{
+    uint32_t v = hdr->n_nodes + 3;
+    test_write(hdr->nodes_off + 5 * sizeof(struct sr_fib_node) +
+               offsetof(struct sr_fib_node, child), &v, sizeof(v));
+}
+
+static void looping_child(struct sr_fib_image_hdr* hdr)
+{
+    uint32_t v = 5;
+    test_write(hdr->nodes_off + 5 * sizeof(struct sr_fib_node) +
+               offsetof(struct sr_fib_node, child), &v, sizeof(v));
+}
+
+static void bad_node_nh(struct sr_fib_image_hdr* hdr)
+{
+    uint32_t v = hdr->n_nexthops;
+    test_write(hdr->nodes_off + 9 * sizeof(struct sr_fib_node) +
+               offsetof(struct sr_fib_node, nh), &v, sizeof(v));
+}
+
+static void bad_tbl8_group(struct sr_fib_image_hdr* hdr)
+{
+    uint32_t v = SR_FIB_DIR_TBL8 | hdr->n_tbl8;
+    test_write(hdr->tbl24_off + 4 * 1234, &v, sizeof(v));
+}
+
+static void bad_tbl24_nh(struct sr_fib_image_hdr* hdr)
+{
+    uint32_t v = hdr->n_nexthops + 1;
+    test_write(hdr->tbl24_off + 4 * 1234, &v, sizeof(v));
+}
+
+static void bad_tbl8_nh(struct sr_fib_image_hdr* hdr)
+{
+    uint32_t v = hdr->n_nexthops + 1;
+    test_write(hdr->tbl8_off + 4 * 7, &v, sizeof(v));
+}
+
+/*---------------------------------------------------------------------
+ * Method: test_mode(..)
+ * Scope:  Local
+ *
+ *---------------------------------------------------------------------*/
+
+static void test_mode(struct sr_instance* sr, int mode)
+{
+    struct sr_fib* fib = test_build(sr, mode);
+    struct sr_fib* mapped = 0;
+    struct sr_nexthop* a = 0;
+    struct sr_nexthop* b = 0;
+    uint32_t i = 0, ip = 0, bad = 0;
+
+    /* -- a good image maps and agrees with the FIB it came from -- */
+    if(sr_fib_write_image(fib, image) != 0)
+    { fprintf(stderr, "cannot write %s\n", image); exit(1); }
+    mapped = sr_fib_map_image(sr, image);
+    test_check(mapped != 0, "good image did not map", mode);
+    if(mapped)
+    {
+        for(i = 0; i < TEST_LOOKUPS; i++)
+        {
+            ip = test_rand32();
+            a = sr_fib_lookup(fib, ip);
+            b = sr_fib_lookup(mapped, ip);
+            if((a == 0) != (b == 0) || (a && a->gw != b->gw))
+            { bad++; }
+        }
+        test_check(bad == 0, "mapped image answers differently", mode);
+        sr_fib_destroy(mapped);
+    }
+
+    test_reject(sr, fib, huge_nexthops, "n_nexthops past the end accepted");
+    test_reject(sr, fib, unaligned_nodes, "unaligned nodes_off accepted");
+    test_reject(sr, fib, unaligned_nexthops, "unaligned nexthops_off accepted");
+    test_reject(sr, fib, truncated, "truncated image accepted");
+
+    if(mode == SR_FIB_TRIE)
+    {
+        test_reject(sr, fib, wrap_nodes_off, "nodes_off wrapping around accepted");
+        test_reject(sr, fib, bad_child, "out of range child accepted");
+        test_reject(sr, fib, looping_child, "looping child accepted");
+        test_reject(sr, fib, bad_node_nh, "out of range node next hop accepted");
+    }
+    else
+    {
+        test_reject(sr, fib, wrap_tbl8_off, "tbl8_off wrapping around accepted");
+        test_reject(sr, fib, bad_tbl8_group, "out of range tbl8 group accepted");
+        test_reject(sr, fib, bad_tbl24_nh, "out of range tbl24 next hop accepted");
+        test_reject(sr, fib, bad_tbl8_nh, "out of range tbl8 next hop accepted");
+    }
+
+    sr_fib_destroy(fib);
+} /* -- test_mode -- */
+
+int main(int argc, char** argv)
+{
+    static struct sr_instance sr;
+    int fd;
+
+    if((fd = mkstemp(image)) < 0)
+    {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+
+    test_mode(&sr, SR_FIB_TRIE);
+    test_mode(&sr, SR_FIB_DIR248);
+    unlink(image);
+
+    if(failures)
+    {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("FIB image: all checks passed\n");
+    return 0;
+} /* -- main -- */
@@ -13,6 +13,7 @@
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
+#include <signal.h>
 
 #ifdef _DARWIN_
 #include <sys/types.h>
@@ -25,6 +26,77 @@
 #include "sr_if.h"
 #include "sr_router.h"
 
+/*--------------------------------------------------------------------- 
+ * Method: sr_if_name_hash(..)
+ * Scope: Local
+ *
+ *---------------------------------------------------------------------*/
+
+static unsigned int sr_if_name_hash(const char* name)
+{
+    unsigned int h = 2166136261u;
+    int i;
+
+    for(i = 0; i < sr_IFACE_NAMELEN && name[i]; i++)
+    { h = (h ^ (unsigned char)name[i]) * 16777619u; }
+
+    return h;
+} /* -- sr_if_name_hash -- */
+
+/*--------------------------------------------------------------------- 
+ * Method: sr_get_ifindex(..)
+ * Scope: Global
+ *
+ * Given an interface name return its index or SR_IF_NONE if it doesn't
+ * exist.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_get_ifindex(struct sr_instance* sr, const char* name)
+{
+    struct sr_if_index* index = 0;
+    unsigned int h = 0;
+    int slot = 0;
+
+    /* -- REQUIRES -- */
+    assert(name);
+    assert(sr);
+
+    index = &(sr->if_index);
+    if(index->n_slots == 0)
+    { return SR_IF_NONE; }
+
+    h = sr_if_name_hash(name) & (index->n_slots - 1);
+    while((slot = index->by_name[h]) != 0)
+    {
+        if(!strncmp(index->by_idx[slot - 1]->name, name, sr_IFACE_NAMELEN))
+        { return slot - 1; }
+        h = (h + 1) & (index->n_slots - 1);
+    }
+
+    return SR_IF_NONE;
+} /* -- sr_get_ifindex -- */
+
+/*--------------------------------------------------------------------- 
+ * Method: sr_get_interface_idx(..)
+ * Scope: Global
+ *
+ * Given an interface index return the interface record or 0 if it
+ * doesn't exist.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_if* sr_get_interface_idx(struct sr_instance* sr, int index)
+{
+    /* -- REQUIRES -- */
+    assert(sr);
+
+    if(index < 0 || index >= sr->if_index.n)
+    { return 0; }
+
+    return sr->if_index.by_idx[index];
+} /* -- sr_get_interface_idx -- */
+
 /*--------------------------------------------------------------------- 
  * Method: sr_get_interface
  * Scope: Global
@@ -36,43 +108,163 @@
 
 struct sr_if* sr_get_interface(struct sr_instance* sr, const char* name)
 {
-    struct sr_if* if_walker = 0;
+    return sr_get_interface_idx(sr, sr_get_ifindex(sr, name));
+} /* -- sr_get_interface -- */
+
+/*--------------------------------------------------------------------- 
+ * Method: sr_if_index_add(..)
+ * Scope: Local
+ *
+ * Give iface the next index and enter it in the name map, which is kept
+ * at most half full.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_if_index_add(struct sr_instance* sr, struct sr_if* iface)
+{
+    struct sr_if_index* index = &(sr->if_index);
+    struct sr_if_stats* stats = 0;
+    unsigned int h = 0;
+    int i;
+
+    iface->index = index->n;
+    index->by_idx = (struct sr_if**)realloc(index->by_idx,
+            (index->n + 1) * sizeof(struct sr_if*));
+    assert(index->by_idx);
+
+    /* -- realloc would not keep the cache line alignment -- */
+    if(posix_memalign((void**)&stats, SR_IF_CACHELINE,
+                      (index->n + 1) * sizeof(struct sr_if_stats)) != 0)
+    { assert(0); }
+    memset(stats, 0, (index->n + 1) * sizeof(struct sr_if_stats));
+    if(index->stats)
+    { memcpy(stats, index->stats, index->n * sizeof(struct sr_if_stats)); }
+    free(index->stats);
+    index->stats = stats;
+
+    index->by_idx[index->n++] = iface;
+
+    if(index->n * 2 > index->n_slots)
+    {
+        free(index->by_name);
+        index->n_slots = index->n_slots ? index->n_slots * 2 : 16;
+        index->by_name = (int*)calloc(index->n_slots, sizeof(int));
+        assert(index->by_name);
+    }
+    else
+    { memset(index->by_name, 0, index->n_slots * sizeof(int)); }
+
+    for(i = 0; i < index->n; i++)
+    {
+        h = sr_if_name_hash(index->by_idx[i]->name) & (index->n_slots - 1);
+        while(index->by_name[h])
+        { h = (h + 1) & (index->n_slots - 1); }
+        index->by_name[h] = i + 1;
+    }
+} /* -- sr_if_index_add -- */
+
+/*--------------------------------------------------------------------- 
+ * Method: sr_if_addr_hash(..)
+ * Scope: Local
+ *
+ * Hash of an address (network byte order) whose low bits depend on all
+ * of it, so neighbouring addresses don't pile up in one probe run.
+ *
+ *---------------------------------------------------------------------*/
+
+static unsigned int sr_if_addr_hash(uint32_t ip)
+{
+    unsigned int h = ntohl(ip) * 2654435761u;
+
+    return h ^ (h >> 16);
+} /* -- sr_if_addr_hash -- */
+
+/*--------------------------------------------------------------------- 
+ * Method: sr_get_ifindex_byip(..)
+ * Scope: Global
+ *
+ * Return the index of the interface owning ip (network byte order), or
+ * SR_IF_NONE if ip is not one of the router's addresses.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_get_ifindex_byip(struct sr_instance* sr, uint32_t ip)
+{
+    struct sr_if_index* index = 0;
+    unsigned int h = 0;
 
     /* -- REQUIRES -- */
-    assert(name);
     assert(sr);
 
-    if_walker = sr->if_list;
+    index = &(sr->if_index);
+    if(ip == 0 || index->n_addr_slots == 0)
+    { return SR_IF_NONE; }
 
-    while(if_walker)
+    h = sr_if_addr_hash(ip) & (index->n_addr_slots - 1);
+    while(index->addrs[h].ip)
     {
-       if(!strncmp(if_walker->name,name,sr_IFACE_NAMELEN))
-        { return if_walker; }
-        if_walker = if_walker->next;
+        if(index->addrs[h].ip == ip)
+        { return index->addrs[h].index; }
+        h = (h + 1) & (index->n_addr_slots - 1);
     }
 
-    return 0;
-} /* -- sr_get_interface -- */
+    return SR_IF_NONE;
+} /* -- sr_get_ifindex_byip -- */
+
+/*--------------------------------------------------------------------- 
+ * Method: sr_get_interface_byip(..)
+ * Scope: Global
+ *
+ * Given an address return the interface owning it or 0 if it isn't one
+ * of ours.
+ *
+ *---------------------------------------------------------------------*/
 
 struct sr_if* sr_get_interface_byip(struct sr_instance* sr, uint32_t ip)
 {
+    return sr_get_interface_idx(sr, sr_get_ifindex_byip(sr, ip));
+} /* -- sr_get_interface_byip -- */
+
+/*--------------------------------------------------------------------- 
+ * Method: sr_if_addrs_rebuild(..)
+ * Scope: Local
+ *
+ * Rebuild the local address set from the interface list, sized to stay
+ * at most half full.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_if_addrs_rebuild(struct sr_instance* sr)
+{
+    struct sr_if_index* index = &(sr->if_index);
     struct sr_if* if_walker = 0;
+    unsigned int h = 0;
+    int n_slots = 16;
 
-    /* -- REQUIRES -- */
-    assert(ip);
-    assert(sr);
+    while(n_slots < 2 * index->n)
+    { n_slots *= 2; }
 
-    if_walker = sr->if_list;
+    free(index->addrs);
+    index->addrs = (struct sr_if_addr*)calloc(n_slots, sizeof(struct sr_if_addr));
+    assert(index->addrs);
+    index->n_addr_slots = n_slots;
 
-    while(if_walker)
+    for(if_walker = sr->if_list; if_walker; if_walker = if_walker->next)
     {
-       if(if_walker->ip == ip)
-        { return if_walker; }
-        if_walker = if_walker->next;
+        if(if_walker->ip == 0)
+        { continue; }
+
+        h = sr_if_addr_hash(if_walker->ip) & (n_slots - 1);
+        while(index->addrs[h].ip && index->addrs[h].ip != if_walker->ip)
+        { h = (h + 1) & (n_slots - 1); }
+        if(index->addrs[h].ip == 0)
+        {
+            index->addrs[h].ip = if_walker->ip;
+            index->addrs[h].index = if_walker->index;
+        }
     }
+} /* -- sr_if_addrs_rebuild -- */
 
-    return 0;
-} /* -- sr_get_interface -- */  
 
 /*--------------------------------------------------------------------- 
  * Method: sr_add_interface(..)
@@ -97,6 +289,7 @@ void sr_add_interface(struct sr_instance* sr, const char* name)
         assert(sr->if_list);
         sr->if_list->next = 0;
         strncpy(sr->if_list->name,name,sr_IFACE_NAMELEN);
+        sr_if_index_add(sr, sr->if_list);
         return;
     }
 
@@ -110,6 +303,7 @@ void sr_add_interface(struct sr_instance* sr, const char* name)
     if_walker = if_walker->next;
     strncpy(if_walker->name,name,sr_IFACE_NAMELEN);
     if_walker->next = 0;
+    sr_if_index_add(sr, if_walker);
 } /* -- sr_add_interface -- */ 
 
 /*--------------------------------------------------------------------- 
@@ -157,6 +351,7 @@ void sr_set_ether_ip(struct sr_instance* sr, uint32_t ip_nbo)
 
     /* -- copy address -- */
     if_walker->ip = ip_nbo;
+    sr_if_addrs_rebuild(sr);
 
 } /* -- sr_set_ether_ip -- */
 
@@ -212,3 +407,79 @@ void sr_print_if(struct sr_if* iface)
     Debug("\n");
     Debug("\tinet addr %s\n",inet_ntoa(ip_addr));
 } /* -- sr_print_if -- */
+
+/*--------------------------------------------------------------------- 
+ * Method: sr_print_if_stats(..)
+ * Scope: Global
+ *
+ * print the traffic counters of every interface to stdout
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_print_if_stats(struct sr_instance* sr)
+{
+    struct sr_if_stats* st = 0;
+    int i;
+
+    printf("Iface\trx pkts\trx bytes\trx drop\ttx pkts\ttx bytes\ttx drop\n");
+    for(i = 0; i < sr->if_index.n; i++)
+    {
+        st = &(sr->if_index.stats[i]);
+        printf("%s\t%lu\t%lu\t\t%lu\t%lu\t%lu\t\t%lu\n",
+               sr->if_index.by_idx[i]->name,
+               st->rx_packets, st->rx_bytes, st->rx_drops,
+               st->tx_packets, st->tx_bytes, st->tx_drops);
+    }
+} /* -- sr_print_if_stats -- */
+
+/*--------------------------------------------------------------------- 
+ * Method: sr_if_stats_dumper(..)
+ * Scope: Global
+ *
+ * Thread that prints the interface and ARP queue counters whenever the
+ * process gets a SIGUSR1.
+ *
+ * It also takes SIGINT and SIGTERM: the first one shuts down our side
+ * of the server connection, so the main loop's read ends and main goes
+ * through sr_destroy_instance (saving the ARP snapshot) as it would if
+ * the server had closed.  A second one exits at once.
+ *
+ * These signals must be blocked in every thread for this to see them.
+ *
+ *---------------------------------------------------------------------*/
+
+void* sr_if_stats_dumper(void* sr_ptr)
+{
+    struct sr_instance* sr = (struct sr_instance*)sr_ptr;
+    sigset_t set;
+    int sig = 0;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+
+    while(1)
+    {
+        if(sigwait(&set, &sig) != 0)
+        { continue; }
+
+        if(sig == SIGINT || sig == SIGTERM)
+        {
+            if(sr->stopping)
+            { exit(1); }
+            fprintf(stderr, "Caught signal %d, shutting down\n", sig);
+            sr->stopping = 1;
+            shutdown(sr->sockfd, SHUT_RD);
+        }
+        else
+        {
+            sr_print_if_stats(sr);
+            sr_print_rx_stats(sr);
+            sr_arpcache_print_stats(&(sr->cache));
+            fflush(stdout);
+        }
+    }
+
+    return 0;
+} /* -- sr_if_stats_dumper -- */
@@ -28,10 +28,15 @@
 
 struct sr_instance;
 
+/* no such interface */
+#define SR_IF_NONE (-1)
+
 /* ----------------------------------------------------------------------------
  * struct sr_if
  *
- * Node in the interface list for each router
+ * Node in the interface list for each router.  Interfaces are also
+ * numbered 0..n-1 in the order they were added; the packet path refers
+ * to them by that index and names are only used at the VNS boundary.
  *
  * -------------------------------------------------------------------------- */
 
@@ -41,15 +46,73 @@ struct sr_if
   unsigned char addr[ETHER_ADDR_LEN];
   uint32_t ip;
   uint32_t speed;
+  int index;
   struct sr_if* next;
 };
 
+/* ----------------------------------------------------------------------------
+ * struct sr_if_stats
+ *
+ * Traffic counters for one interface, kept in an array parallel to the
+ * interface index and padded to a cache line each so interfaces never
+ * share one.  rx_* are only written by the thread reading from the
+ * server; tx_* are bumped atomically since both the packet and the ARP
+ * sweep threads send.
+ *
+ * -------------------------------------------------------------------------- */
+
+#define SR_IF_CACHELINE 64
+
+struct sr_if_stats
+{
+  unsigned long rx_packets;
+  unsigned long rx_bytes;
+  unsigned long rx_drops;             /* received but not for us */
+  unsigned long tx_packets;
+  unsigned long tx_bytes;
+  unsigned long tx_drops;             /* rejected or failed to send */
+} __attribute__ ((aligned (SR_IF_CACHELINE)));
+
+/* slot of the local address set, ip 0 marks an empty slot */
+struct sr_if_addr
+{
+  uint32_t ip;                  /* nbo */
+  int index;                    /* interface owning ip */
+};
+
+/* ----------------------------------------------------------------------------
+ * struct sr_if_index
+ *
+ * index -> interface array plus an open addressed name -> index map
+ * (slots hold index + 1, 0 is empty).  Built as interfaces are added.
+ * addrs is an open addressed set of every address the router owns,
+ * rebuilt whenever an interface address changes.  stats[i] counts
+ * traffic on interface i.
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_if_index
+{
+  struct sr_if** by_idx;
+  int n;
+  int* by_name;
+  int n_slots;
+  struct sr_if_addr* addrs;
+  int n_addr_slots;
+  struct sr_if_stats* stats;
+};
+
 struct sr_if* sr_get_interface(struct sr_instance* sr, const char* name);
+struct sr_if* sr_get_interface_idx(struct sr_instance* sr, int index);
+int sr_get_ifindex(struct sr_instance* sr, const char* name);
+int sr_get_ifindex_byip(struct sr_instance* sr, uint32_t ip);
 struct sr_if* sr_get_interface_byip(struct sr_instance* sr, uint32_t ip);
 void sr_add_interface(struct sr_instance*, const char*);
 void sr_set_ether_addr(struct sr_instance*, const unsigned char*);
 void sr_set_ether_ip(struct sr_instance*, uint32_t ip_nbo);
 void sr_print_if_list(struct sr_instance*);
 void sr_print_if(struct sr_if*);
+void sr_print_if_stats(struct sr_instance*);
+void* sr_if_stats_dumper(void*);
 
 #endif /* --  sr_INTERFACE_H -- */
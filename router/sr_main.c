@@ -32,6 +32,7 @@
 #include "sr_dumper.h"
 #include "sr_router.h"
 #include "sr_rt.h"
+#include "sr_fib.h"
 
 extern char* optarg;
 
@@ -65,11 +66,18 @@ int main(int argc, char **argv)
     unsigned int port = DEFAULT_PORT;
     unsigned int topo = DEFAULT_TOPO;
     char *logfile = 0;
+    char *image = 0;
+    unsigned int arp_max_entries = 0;
+    struct sr_arpq_limits arp_queue_limits;
+    char *arp_snapshot = 0;
+    int fib_mode = SR_FIB_TRIE;
     struct sr_instance sr;
 
     printf("Using %s\n", VERSION_INFO);
 
-    while ((c = getopt(argc, argv, "hs:v:p:u:t:r:l:T:")) != EOF)
+    memset(&arp_queue_limits, 0, sizeof(arp_queue_limits));
+
+    while ((c = getopt(argc, argv, "hs:v:p:u:t:r:dc:a:q:Q:OA:l:T:")) != EOF)
     {
         switch (c)
         {
@@ -98,6 +106,29 @@ int main(int argc, char **argv)
             case 'r':
                 rtable = optarg;
                 break;
+            case 'd':
+                fib_mode = SR_FIB_DIR248;
+                break;
+            case 'c':
+                image = optarg;
+                break;
+            case 'a':
+                arp_max_entries = atoi((char *) optarg);
+                break;
+            case 'q':
+                sscanf(optarg, "%u,%u", &arp_queue_limits.req_packets,
+                       &arp_queue_limits.req_bytes);
+                break;
+            case 'Q':
+                sscanf(optarg, "%u,%u", &arp_queue_limits.max_packets,
+                       &arp_queue_limits.max_bytes);
+                break;
+            case 'O':
+                arp_queue_limits.policy = SR_ARPQ_DROP_OLDEST;
+                break;
+            case 'A':
+                arp_snapshot = optarg;
+                break;
             case 'T':
                 template = optarg;
                 break;
@@ -106,6 +137,23 @@ int main(int argc, char **argv)
 
     /* -- zero out sr instance -- */
     sr_init_instance(&sr);
+    sr.fib_mode = fib_mode;
+    sr.arp_max_entries = arp_max_entries;
+    sr.arp_queue_limits = arp_queue_limits;
+    sr.arp_snapshot = arp_snapshot;
+
+    /* -- compile the routing table into a FIB image and quit -- */
+    if(image)
+    {
+        sr_load_rt_wrap(&sr, rtable);
+        if(sr_fib_write_image(sr_fib_current(&(sr.fib_rcu)), image) != 0)
+        {
+            fprintf(stderr,"Error writing FIB image %s\n", image);
+            exit(1);
+        }
+        printf("Wrote FIB image %s\n", image);
+        exit(0);
+    }
 
     /* -- set up routing table from file -- */
     if(template == NULL) {
@@ -177,10 +225,21 @@ static void usage(char* argv0)
     printf("Simple Router Client\n");
     printf("Format: %s [-h] [-v host] [-s server] [-p port] \n",argv0);
     printf("           [-T template_name] [-u username] \n");
-    printf("           [-t topo id] [-r routing table] \n");
-    printf("           [-l log file] \n");
+    printf("           [-t topo id] [-r routing table] [-d] \n");
+    printf("           [-c FIB image] [-a ARP cache entries] [-l log file] \n");
+    printf("           [-q pkts[,bytes]] [-Q pkts[,bytes]] [-O] [-A ARP snapshot] \n");
     printf("   defaults server=%s port=%d host=%s  \n",
             DEFAULT_SERVER, DEFAULT_PORT, DEFAULT_HOST );
+    printf("   -d uses a DIR-24-8 lookup table (64MB) instead of a trie\n");
+    printf("   -c compiles the routing table into a FIB image and exits;\n");
+    printf("      pass the image to -r to map it instead of parsing\n");
+    printf("   -a caps the ARP cache (default %d entries)\n", SR_ARPCACHE_SZ);
+    printf("   -q caps packets waiting on one ARP request (default %d,%d)\n",
+            SR_ARPQ_REQ_PACKETS, SR_ARPQ_REQ_BYTES);
+    printf("   -Q caps packets waiting on all ARP requests (default %d,%d)\n",
+            SR_ARPQ_MAX_PACKETS, SR_ARPQ_MAX_BYTES);
+    printf("   -O drops the oldest waiting packets instead of new ones\n");
+    printf("   -A saves the ARP cache to a file at exit and reloads it at start\n");
 } /* -- usage -- */
 
 /*-----------------------------------------------------------------------------
@@ -225,6 +284,19 @@ static void sr_destroy_instance(struct sr_instance* sr)
         sr_dump_close(sr->logfile);
     }
 
+    sr_print_rt_cache_stats(sr);
+    sr_print_if_stats(sr);
+    sr_print_rx_stats(sr);
+    sr_arpcache_print_stats(&(sr->cache));
+
+    if(sr->arp_snapshot && sr_arpcache_save(sr, sr->arp_snapshot) != 0)
+    {
+        fprintf(stderr,"Error saving ARP cache to %s\n", sr->arp_snapshot);
+    }
+
+    free(sr->rx.buf);
+    sr->rx.buf = 0;
+
     /*
     fprintf(stderr,"sr_destroy_instance leaking memory\n");
     */
@@ -243,11 +315,21 @@ static void sr_init_instance(struct sr_instance* sr)
     assert(sr);
 
     sr->sockfd = -1;
+    memset(&(sr->rx), 0, sizeof(sr->rx));
     sr->user[0] = 0;
     sr->host[0] = 0;
     sr->topo_id = 0;
     sr->if_list = 0;
+    memset(&(sr->if_index), 0, sizeof(sr->if_index));
     sr->routing_table = 0;
+    sr_fib_rcu_init(&(sr->fib_rcu));
+    sr->rtable_file = 0;
+    sr->fib_mode = SR_FIB_TRIE;
+    sr->rt_cache = 0;
+    sr->arp_max_entries = 0;
+    memset(&(sr->arp_queue_limits), 0, sizeof(sr->arp_queue_limits));
+    sr->arp_snapshot = 0;
+    sr->stopping = 0;
     sr->logfile = 0;
 } /* -- sr_init_instance -- */
 
@@ -268,36 +350,31 @@ static void sr_init_instance(struct sr_instance* sr)
 
 int sr_verify_routing_table(struct sr_instance* sr)
 {
-    struct sr_rt* rt_walker = 0;
-    struct sr_if* if_walker = 0;
+    struct sr_fib* fib = 0;
+    uint32_t i = 0;
     int ret = 0;
+    int slot;
 
     /* -- REQUIRES --*/
     assert(sr);
 
-    if( (sr->if_list == 0) || (sr->routing_table == 0))
+    slot = sr_fib_read_lock(&(sr->fib_rcu));
+    fib = sr_fib_current(&(sr->fib_rcu));
+
+    if( (sr->if_list == 0) || (fib == 0) || (fib->n_routes == 0))
     {
+        sr_fib_read_unlock(&(sr->fib_rcu), slot);
         return 999; /* doh! */
     }
 
-    rt_walker = sr->routing_table;
-
-    while(rt_walker)
+    /* -- every route points at one of these, bound against if_list -- */
+    for(i = 0; i < fib->n_nexthops; i++)
     {
-        /* -- check to see if interface exists -- */
-        if_walker = sr->if_list;
-        while(if_walker)
-        {
-            if( strncmp(if_walker->name,rt_walker->interface,sr_IFACE_NAMELEN)
-                    == 0)
-            { break; }
-            if_walker = if_walker->next;
-        }
-        if(if_walker == 0)
+        if(sr_get_interface(sr, fib->nexthops[i].ifname) == 0)
         { ret++; } /* -- interface not found! -- */
+    }
 
-        rt_walker = rt_walker->next;
-    } /* -- while -- */
+    sr_fib_read_unlock(&(sr->fib_rcu), slot);
 
     return ret;
 } /* -- sr_verify_routing_table -- */
@@ -308,6 +385,7 @@ static void sr_load_rt_wrap(struct sr_instance* sr, char* rtable) {
                 rtable);
         exit(1);
     }
+    sr->rtable_file = rtable;
 
 
     printf("Loading routing table\n");
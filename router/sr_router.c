@@ -15,10 +15,12 @@
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
+#include <signal.h>
 
 
 #include "sr_if.h"
 #include "sr_rt.h"
+#include "sr_fib.h"
 #include "sr_router.h"
 #include "sr_protocol.h"
 #include "sr_arpcache.h"
@@ -41,7 +43,11 @@ void sr_init(struct sr_instance* sr)
     assert(sr);
 
     /* Initialize cache and cache cleanup thread */
-    sr_arpcache_init(&(sr->cache));
+    sr_arpcache_init(&(sr->cache), sr->arp_max_entries, &(sr->arp_queue_limits));
+
+    /* Destination cache in front of the routing table */
+    sr->rt_cache = (struct sr_rt_cache*)calloc(1, sizeof(struct sr_rt_cache));
+    assert(sr->rt_cache);
 
     pthread_attr_init(&(sr->attr));
     pthread_attr_setdetachstate(&(sr->attr), PTHREAD_CREATE_JOINABLE);
@@ -49,44 +55,110 @@ void sr_init(struct sr_instance* sr)
     pthread_attr_setscope(&(sr->attr), PTHREAD_SCOPE_SYSTEM);
     pthread_t thread;
 
+    /* SIGHUP is only ever taken by the routing table reload thread,
+       SIGUSR1, SIGINT and SIGTERM by the interface counter dump thread */
+    sigset_t hup;
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    sigaddset(&hup, SIGUSR1);
+    sigaddset(&hup, SIGINT);
+    sigaddset(&hup, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &hup, 0);
+
     pthread_create(&thread, &(sr->attr), sr_arpcache_timeout, sr);
+    pthread_create(&thread, &(sr->attr), sr_rt_reloader, sr);
+    pthread_create(&thread, &(sr->attr), sr_if_stats_dumper, sr);
     
     /* Add initialization code here! */
 
 } /* -- sr_init -- */
 
 /*---------------------------------------------------------------------
- * Method: sr_handlepacket(uint8_t* p,char* interface)
+ * Method: sr_arp_learn(..)
+ * Scope:  Local
+ *
+ * Caches the sender of an ARP packet received on ifindex and sends the
+ * packets that were waiting for its address, if any.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_arp_learn(struct sr_instance* sr, sr_arp_hdr_t* arp_hdr, int ifindex)
+{
+	struct sr_arpcache *cache = &(sr->cache);
+	struct sr_if* out_iface = 0;
+	struct sr_arpreq *req;
+
+	/* ARP probes (RFC 5227) come from 0.0.0.0, nothing to learn; and
+	   someone claiming one of our addresses is not a neighbour */
+	if (arp_hdr->ar_sip == 0 ||
+			sr_get_ifindex_byip(sr, arp_hdr->ar_sip) != SR_IF_NONE)
+		return;
+
+	req = sr_arpcache_insert(cache, arp_hdr->ar_sha, arp_hdr->ar_sip, ifindex);
+	struct sr_packet *pkt, *nxt;
+
+	/* refreshes and most requests have no request waiting on them */
+	for (pkt = req ? req->packets : NULL; pkt; pkt = nxt) {
+		/*handle_ip(sr, pkt->buf, pkt->len, pkt->iface);*/
+		out_iface = sr_get_interface_idx(sr, pkt->ifindex);
+		assert(out_iface);
+		/* update ethernet header */
+		sr_ethernet_hdr_t* ethernet_hdr = (sr_ethernet_hdr_t *)(pkt->buf);
+		memcpy(ethernet_hdr->ether_dhost, arp_hdr->ar_sha, sizeof(uint8_t)*ETHER_ADDR_LEN);
+		memcpy(ethernet_hdr->ether_shost, out_iface->addr, sizeof(uint8_t)*ETHER_ADDR_LEN);
+
+		/* update ip header */
+
+		sr_ip_hdr_t* ip_hdr = (sr_ip_hdr_t *)(pkt->buf + sizeof(struct sr_ethernet_hdr));
+
+		ip_hdr->ip_ttl--;
+		bzero(&(ip_hdr->ip_sum), 2);
+		uint16_t ip_cksum = cksum(ip_hdr, sizeof(struct sr_ip_hdr));
+		ip_hdr->ip_sum = ip_cksum;
+
+		printf("Send packet:\n");
+		/*print_hdrs(pkt->buf, pkt->len);*/
+		sr_send_packet_idx(sr, pkt->buf, pkt->len, pkt->ifindex);
+		nxt = pkt->next;
+	}
+	if (req)
+		sr_arpreq_destroy(cache, req);
+} /* -- sr_arp_learn -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_handlepacket(uint8_t* p,int ifindex)
  * Scope:  Global
  *
  * This method is called each time the router receives a packet on the
- * interface.  The packet buffer, the packet length and the receiving
- * interface are passed in as parameters. The packet is complete with
- * ethernet headers.
+ * interface.  The packet buffer, the packet length and the index of the
+ * receiving interface (see sr_get_interface_idx) are passed in as
+ * parameters. The packet is complete with ethernet headers.
+ *
+ * Note: The packet buffer is handled by sr_vns_comm.c that means do NOT
+ * delete it.  Make a copy of the packet instead if you intend to keep it
+ * around beyond the scope of the method call.
  *
- * Note: Both the packet buffer and the character's memory are handled
- * by sr_vns_comm.c that means do NOT delete either.  Make a copy of the
- * packet instead if you intend to keep it around beyond the scope of
- * the method call.
+ * The buffer is a view into the receive ring and is exactly len bytes:
+ * the next message from the server may follow it, so never write past
+ * len.  Build anything longer than the packet in a buffer of its own.
  *
  *---------------------------------------------------------------------*/
 
 void sr_handlepacket(struct sr_instance* sr,
         uint8_t * packet/* lent */,
         unsigned int len,
-        char* interface/* lent */)
+        int ifindex/* index of receiving interface */)
 {
 	/* REQUIRES */
 	assert(sr);
 	assert(packet);
-	assert(interface);
-	struct sr_if* out_iface = 0;
-
-	struct sr_arpreq *req;
-	struct sr_arpcache *cache = &(sr->cache);
+	assert(sr_get_interface_idx(sr, ifindex));
 
 	uint16_t ethtype = ethertype(packet);
 
+	/* routes found while handling this packet stay valid until we return */
+	int fib_slot = sr_fib_read_lock(&(sr->fib_rcu));
+
 	printf("*** -> Received packet of length %d \n",len);
 	/*printf("%u \n", packet);*/
 	
@@ -96,46 +168,26 @@ void sr_handlepacket(struct sr_instance* sr,
 
 		uint8_t* arp_data = packet +  sizeof(sr_ethernet_hdr_t);
 		sr_arp_hdr_t* arp_hdr = (sr_arp_hdr_t *) arp_data;
-		if (arp_hdr->ar_op == htons(arp_op_request)){
-			send_arpreply(sr, packet, len, interface);
+		/* a gratuitous ARP announces the sender's own address */
+		int gratuitous = (arp_hdr->ar_sip == arp_hdr->ar_tip);
+
+		if (arp_hdr->ar_op == htons(arp_op_request) && !gratuitous){
+			/* the asker is about to talk to us, keep its address too */
+			sr_arp_learn(sr, arp_hdr, ifindex);
+			send_arpreply(sr, packet, len, ifindex);
 			/*sr_print_routing_table(sr);*/
 		}
 
-		else if(arp_hdr->ar_op == htons(arp_op_reply)){
-			req = sr_arpcache_insert(cache, arp_hdr->ar_sha, arp_hdr->ar_sip);
-			struct sr_packet *pkt, *nxt;
-        
-        	for (pkt = req->packets; pkt; pkt = nxt) {
-        		/*handle_ip(sr, pkt->buf, pkt->len, pkt->iface);*/
-        		out_iface = sr_get_interface(sr, pkt->iface);
-		      	assert(out_iface);
-		      /* update ethernet header */
-		      	sr_ethernet_hdr_t* ethernet_hdr = (sr_ethernet_hdr_t *)(pkt->buf);
-		      	memcpy(ethernet_hdr->ether_dhost, arp_hdr->ar_sha, sizeof(uint8_t)*ETHER_ADDR_LEN);
-		      	memcpy(ethernet_hdr->ether_shost, out_iface->addr, sizeof(uint8_t)*ETHER_ADDR_LEN);
-		        
-		      /* update ip header */
-
-		      	sr_ip_hdr_t* ip_hdr = (sr_ip_hdr_t *)(pkt->buf + sizeof(struct sr_ethernet_hdr));
-
-		      	ip_hdr->ip_ttl--;
-		      	bzero(&(ip_hdr->ip_sum), 2);
-		      	uint16_t ip_cksum = cksum(ip_hdr, sizeof(struct sr_ip_hdr));
-		      	ip_hdr->ip_sum = ip_cksum;
-
-		      	printf("Send packet:\n");
-		      	/*print_hdrs(pkt->buf, pkt->len);*/
-		      	sr_send_packet(sr, pkt->buf, pkt->len, pkt->iface);
-            	nxt = pkt->next;
-            }
-            sr_arpreq_destroy(cache, req);
+		else if(arp_hdr->ar_op == htons(arp_op_reply) ||
+				arp_hdr->ar_op == htons(arp_op_request)){
+			sr_arp_learn(sr, arp_hdr, ifindex);
 		}
 		
 	}
 	
 	else if (ethtype == ethertype_ip) {
 
-		handle_ip(sr, packet, len, interface);
+		handle_ip(sr, packet, len, ifindex);
 		
 		/*send_arprequest(sr, htonl(3232236033));*/
 		
@@ -150,17 +202,50 @@ void sr_handlepacket(struct sr_instance* sr,
 
   /* fill in code here */
 
+	sr_fib_read_unlock(&(sr->fib_rcu), fib_slot);
+
 }/* end sr_ForwardPacket */
 
+/*---------------------------------------------------------------------
+ * Method: sr_flow_hash(..)
+ * Scope:  Local
+ *
+ * Hash of the packet's 5-tuple (addresses, protocol and, for unfragmented
+ * TCP/UDP, ports) used to keep a flow on one path of an ECMP route.
+ *
+ *---------------------------------------------------------------------*/
+
+static uint32_t sr_flow_hash(sr_ip_hdr_t* iphdr, unsigned int ip_len)
+{
+	unsigned int hl = iphdr->ip_hl * 4;
+	uint32_t h = iphdr->ip_src ^ (iphdr->ip_dst * 2654435761u) ^ iphdr->ip_p;
+	uint32_t ports = 0;
+
+	if((iphdr->ip_p == ip_protocol_tcp || iphdr->ip_p == ip_protocol_udp) &&
+	   (ntohs(iphdr->ip_off) & IP_OFFMASK) == 0 && ip_len >= hl + 4){
+		memcpy(&ports, (uint8_t*)iphdr + hl, 4);
+		h ^= ports * 2246822519u;
+	}
+
+	/* -- finalize so every bit of the tuple reaches the low bits -- */
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+
+	return h;
+}
+
 void handle_ip(struct sr_instance* sr, 
 		uint8_t * packet/* lent */,
         unsigned int len,
-        char* name/* sent from*/)
+        int ifindex/* sent from*/)
 
 {
 	struct sr_if* iface = 0;
-	char outgoing_iface[sr_IFACE_NAMELEN];
-	bzero(outgoing_iface, sr_IFACE_NAMELEN);
+	struct sr_nexthop* nh = 0;
+	uint32_t nh_ip = 0;
 	struct sr_arpcache *cache = &(sr->cache);
 	uint8_t* ip_data = packet +  sizeof(sr_ethernet_hdr_t);
 	sr_ip_hdr_t *iphdr = (sr_ip_hdr_t *)(ip_data);
@@ -172,8 +257,8 @@ void handle_ip(struct sr_instance* sr,
 	
 
 	if((iphdr->ip_p == ip_protocol_icmp) && (icmp_hdr->icmp_type == 3) && (icmp_hdr->icmp_code == 1)){
-		printf("IM HERE with %s\n", name);
-			iface = sr_get_interface(sr, name);
+		printf("IM HERE with %d\n", ifindex);
+			iface = sr_get_interface_idx(sr, ifindex);
 			print_addr_ip_int(ntohl(iface->ip));
 			handle_icmp(sr, packet, len, iface, 3, 1);
 			return;
@@ -197,41 +282,56 @@ void handle_ip(struct sr_instance* sr,
 	/*print_hdr_ip(ip_data);*/
 
 	printf("%d\n", ntohl(iphdr->ip_dst));
-	struct sr_arpentry* entry = sr_arpcache_lookup(cache, iphdr->ip_dst);
 
-	sr_longest_prefix_iface(sr, iphdr->ip_dst, outgoing_iface);
-	printf("OUT ON: %s\n", outgoing_iface);
+	/* one lookup gives the gateway to ARP for and the outgoing interface */
+	nh = sr_rt_cache_nexthop(sr, iphdr->ip_dst);
+	if(nh && nh->n_paths > 1){
+		nh = sr_fib_select_path(nh,
+				sr_flow_hash(iphdr, len - sizeof(sr_ethernet_hdr_t)));
+	}
+	if(nh && nh->iface == 0){
+		nh = 0;
+	}
+	nh_ip = nh ? SR_NEXTHOP_IP(nh, iphdr->ip_dst) : 0;
 
-	
+	/* before the ARP lookup, which marks the neighbour in use: only
+	   packets we forward should keep it refreshed */
 	if(iphdr->ip_ttl <=1){
 		printf("Sending TYPE 11 ICMP\n" );
-		iface = sr_get_interface(sr, name);
+		iface = sr_get_interface_idx(sr, ifindex);
 		handle_icmp(sr, packet, len,iface, 11, 0);
 		return;
 	}
 
+	struct sr_arpentry entry;
+	int arp_hit = nh ? sr_arpcache_lookup_mac(cache, nh_ip, &entry) : 0;
+
 
-	if(entry && entry->valid == 1){/*cache hit*/
+	if(arp_hit && entry.valid == 1){/*cache hit*/
 		
-		iface = sr_get_interface(sr, outgoing_iface);
-		memcpy(eth_hdr->ether_dhost, entry->mac, sizeof(uint8_t)*ETHER_ADDR_LEN);
-		memcpy(eth_hdr->ether_shost, iface->addr, sizeof(uint8_t)*ETHER_ADDR_LEN);
+		memcpy(eth_hdr->ether_dhost, entry.mac, sizeof(uint8_t)*ETHER_ADDR_LEN);
+		memcpy(eth_hdr->ether_shost, nh->mac, sizeof(uint8_t)*ETHER_ADDR_LEN);
 
 		iphdr->ip_sum = 0;
 		iphdr->ip_ttl--;
 		iphdr->ip_sum = cksum(iphdr, sizeof(sr_ip_hdr_t));
 
-		if (sr_send_packet(sr, packet, len, iface->name) == -1 ) {
+		if (sr_send_packet_idx(sr, packet, len, nh->ifindex) == -1 ) {
 			fprintf(stderr, "CANNOT FORWARD IP PACKET \n");
 		}
 		
 	}
-	else if(outgoing_iface[0]!=0){ 
+	else if(arp_hit){
+		/* next hop recently failed to answer ARP */
+		iface = sr_get_interface_idx(sr, ifindex);
+		handle_icmp(sr, packet, len, iface, 3, 1);
+	}
+	else if(nh){ 
 		
-		sr_arpcache_queuereq(cache, iphdr->ip_dst, packet, len, outgoing_iface);
+		sr_arpcache_queuereq(cache, nh_ip, packet, len, nh->ifindex);
 	}
 	else{
-		iface = sr_get_interface(sr, name);
+		iface = sr_get_interface_idx(sr, ifindex);
 		handle_icmp(sr, packet, len,iface, 3, 0);
 	}
 }
@@ -241,26 +341,58 @@ void handle_icmp(struct sr_instance* sr,
 				struct sr_if* iface, 
 				int type, int code)
 {
-	char outgoing_iface[sr_IFACE_NAMELEN];
-
 	struct sr_arpcache *cache = &(sr->cache);
 
+	/* packet is exactly len bytes, too short to answer without reading
+	   past it */
+	if(len < (int)(sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t))){
+		fprintf(stderr, "PACKET TOO SHORT FOR ICMP REPLY \n");
+		return;
+	}
+
 	sr_ethernet_hdr_t *eth_hdr = (sr_ethernet_hdr_t*) packet;
 
 	uint8_t* ip_data = packet +  sizeof(sr_ethernet_hdr_t);
 	sr_ip_hdr_t* ip_hdr = (sr_ip_hdr_t *)(ip_data);
 
-	uint8_t* icmp_payload = (uint8_t*) malloc((sizeof(sr_ip_hdr_t) +8));
-	memcpy(icmp_payload, ip_data, (sizeof(sr_ip_hdr_t) +8));
+	/* route back to the sender; nothing to do if we have none */
+	struct sr_nexthop* nh = sr_rt_cache_nexthop(sr, ip_hdr->ip_src);
+	if(nh == 0 || nh->iface == 0){
+		fprintf(stderr, "NO ROUTE FOR ICMP REPLY \n");
+		return;
+	}
+	uint32_t nh_ip = SR_NEXTHOP_IP(nh, ip_hdr->ip_src);
+
+	/* the offending header and 8 bytes, no more than the packet holds */
+	uint8_t icmp_payload[sizeof(sr_ip_hdr_t) + 8];
+	int n_payload = len - (int)sizeof(sr_ethernet_hdr_t);
+	if(n_payload > (int)sizeof(icmp_payload))
+		n_payload = sizeof(icmp_payload);
+	if(n_payload < 0)
+		n_payload = 0;
+	memset(icmp_payload, 0, sizeof(icmp_payload));
+	memcpy(icmp_payload, ip_data, n_payload);
+
+	/* errors are longer than a short packet, so build them in their own
+	   buffer: packet is exactly len bytes, the next message from the
+	   server may follow it */
+	uint8_t reply[sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + sizeof(sr_icmp_t3_hdr_t)];
+	if(type == 3 || type == 11){
+		memset(reply, 0, sizeof(reply));
+		memcpy(reply, packet, sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
+		packet = reply;
+		len = sizeof(reply);
+		eth_hdr = (sr_ethernet_hdr_t*) packet;
+		ip_data = packet + sizeof(sr_ethernet_hdr_t);
+		ip_hdr = (sr_ip_hdr_t *)(ip_data);
+	}
 
-	struct sr_arpentry* entry = sr_arpcache_lookup(cache, ip_hdr->ip_src);
-	sr_longest_prefix_iface(sr, ip_hdr->ip_src, outgoing_iface);
+	struct sr_arpentry entry;
+	int arp_hit = sr_arpcache_lookup_mac(cache, nh_ip, &entry);
 
 	uint8_t* icmp_data = packet +  sizeof(sr_ethernet_hdr_t)+  sizeof(sr_ip_hdr_t);
 
 	uint32_t ip_src = ip_hdr->ip_src;
-	
-	struct sr_if* out_iface = 0;
 
 	ip_hdr->ip_p = ip_protocol_icmp;
 
@@ -275,14 +407,13 @@ void handle_icmp(struct sr_instance* sr,
 		icmp_hdr->icmp_sum = cksum(icmp_hdr, (len-(sizeof(sr_ethernet_hdr_t)+ sizeof(sr_ip_hdr_t))));
 	}
 	else if(type == 3 || type == 11){
-		len = 70;
 		sr_icmp_t3_hdr_t* icmp_hdr = (sr_icmp_t3_hdr_t *)icmp_data;
 		printf("i should not be here\n");
 		
 		
 
 		/*if(icmp_hdr->icmp_type != (uint8_t)type){*/
-			ip_hdr->ip_len = htons(56);
+			ip_hdr->ip_len = htons(sizeof(sr_ip_hdr_t) + sizeof(sr_icmp_t3_hdr_t));
 			/*ip_hdr->ip_dst = iface->ip;*/
 			icmp_hdr->icmp_type = (uint8_t)type;
 			icmp_hdr->icmp_code = (uint8_t)code;
@@ -297,18 +428,16 @@ void handle_icmp(struct sr_instance* sr,
 		}*/
 		
 	}
-	sr_longest_prefix_iface(sr, ip_hdr->ip_src, outgoing_iface);
-	out_iface = sr_get_interface(sr, outgoing_iface);
 	ip_hdr->ip_ttl = 100;
 	ip_hdr->ip_dst = ip_src;	
 	ip_hdr->ip_src = iface->ip;
 	
-	if(entry && entry->valid == 1){
+	if(arp_hit && entry.valid == 1){
 		
 		/*bzero(eth_hdr->ether_dhost, 6);*/
 		
-		memcpy(eth_hdr->ether_dhost, entry->mac, sizeof(uint8_t)*ETHER_ADDR_LEN);
-		memcpy(eth_hdr->ether_shost, out_iface->addr, sizeof(uint8_t)*ETHER_ADDR_LEN);
+		memcpy(eth_hdr->ether_dhost, entry.mac, sizeof(uint8_t)*ETHER_ADDR_LEN);
+		memcpy(eth_hdr->ether_shost, nh->mac, sizeof(uint8_t)*ETHER_ADDR_LEN);
 		/*eth_hdr->ether_type = htons(ethertype_ip);*/
 
 		
@@ -323,37 +452,50 @@ void handle_icmp(struct sr_instance* sr,
 		bzero(&(ip_hdr->ip_sum), 2);
 		ip_hdr->ip_sum = cksum(ip_hdr, 4*(ip_hdr->ip_hl));
 		/*cksum(ip_data, sizeof(sr_ip_hdr_t));*/
-		printf("hit %s\n", outgoing_iface);
-		if (sr_send_packet(sr, packet, len, outgoing_iface) == -1 ) {
+		printf("hit %s\n", nh->ifname);
+		if (sr_send_packet_idx(sr, packet, len, nh->ifindex) == -1 ) {
 					fprintf(stderr, "CANNOT SEND ICMP PACKET \n");
 				}
 	}
+	else if(arp_hit){
+		/* no ICMP about ICMP to a next hop that does not answer */
+		printf("dead next hop %s\n", nh->ifname);
+	}
 	else{
 		
-		printf("cache miss %s\n", outgoing_iface);
-		sr_arpcache_queuereq(cache, ip_hdr->ip_dst, packet, len, outgoing_iface);
+		printf("cache miss %s\n", nh->ifname);
+		sr_arpcache_queuereq(cache, nh_ip, packet, len, nh->ifindex);
 	}
 
 }
 
 
 
-void send_arprequest(struct sr_instance* sr, uint32_t ip, char* name)
+void send_arprequest(struct sr_instance* sr, uint32_t ip, int ifindex)
 {
-	unsigned int len=42;
 	/* Assume MAC address is not found in ARP cache. We are using the next IP hop*/
+	uint8_t broadcast_addr[ETHER_ADDR_LEN]  = {255, 255, 255, 255, 255, 255};
+
+	send_arprequest_to(sr, ip, broadcast_addr, ifindex);
+}
+
+/* ARP request for ip sent to dhost only, to refresh a cache entry */
+void send_arprequest_to(struct sr_instance* sr, uint32_t ip, const uint8_t* dhost, int ifindex)
+{
+	unsigned int len=42;
 	struct sr_if* iface = 0;
 
 
-	iface = sr_get_interface(sr, name);
-	uint8_t broadcast_addr[ETHER_ADDR_LEN]  = {255, 255, 255, 255, 255, 255};
+	iface = sr_get_interface_idx(sr, ifindex);
+	if (!iface)
+		return;
 	
 	uint8_t* arp_packet = (uint8_t*) malloc(len);
 	/*memcpy(arp_packet, packet, len);*/
 	
 	sr_ethernet_hdr_t *eth_hdr = (sr_ethernet_hdr_t*) arp_packet;
 	/*bzero(eth_hdr->ether_dhost, 6);*/
-	memcpy(eth_hdr->ether_dhost, broadcast_addr, sizeof(uint8_t)*ETHER_ADDR_LEN);
+	memcpy(eth_hdr->ether_dhost, dhost, sizeof(uint8_t)*ETHER_ADDR_LEN);
 	memcpy(eth_hdr->ether_shost, iface->addr, sizeof(uint8_t)*ETHER_ADDR_LEN);
 	eth_hdr->ether_type = htons(ethertype_arp);
 	
@@ -371,16 +513,17 @@ void send_arprequest(struct sr_instance* sr, uint32_t ip, char* name)
 	bzero(arp_hdr->ar_tha, sizeof(uint8_t)*ETHER_ADDR_LEN);
 	arp_hdr->ar_tip = ip;
 	
-	if (sr_send_packet(sr, arp_packet, len, iface->name) == -1 ) {
+	if (sr_send_packet_idx(sr, arp_packet, len, ifindex) == -1 ) {
 		fprintf(stderr, "CANNOT SEND ARP REQUEST \n");
 	}
+	free(arp_packet);
 	
 }
 
 void send_arpreply(struct sr_instance* sr,
 				uint8_t* packet,
 				unsigned int len,
-				const char* name) {
+				int ifindex) {
 
 	/*sr_arp_hdr_t *arp_hdr = (sr_arp_hdr_t *)(packet);*/
 					
@@ -392,7 +535,7 @@ void send_arpreply(struct sr_instance* sr,
 					
 	sr_ethernet_hdr_t *eth_hdr = (sr_ethernet_hdr_t *)arp_packet;
 	memcpy(eth_hdr->ether_dhost, eth_hdr->ether_shost,6);
-	iface = sr_get_interface(sr, name);
+	iface = sr_get_interface_idx(sr, ifindex);
 	memcpy(eth_hdr->ether_shost,iface->addr,6);
 	
 	/* Create ARP packet */
@@ -421,7 +564,7 @@ void send_arpreply(struct sr_instance* sr,
                          const char* iface  borrowed )
 	*/
 	
-	if (sr_send_packet(sr, arp_packet, len, name) == -1 ) {
+	if (sr_send_packet_idx(sr, arp_packet, len, ifindex) == -1 ) {
 		fprintf(stderr, "CANNOT SEND ARP REPLY \n");
 	}
 	
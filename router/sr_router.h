@@ -15,6 +15,7 @@
 
 #include "sr_protocol.h"
 #include "sr_arpcache.h"
+#include "sr_fib.h"
 
 /* we dont like this debug , but what to do for varargs ? */
 #ifdef _DEBUG_
@@ -33,6 +34,32 @@
 /* forward declare */
 struct sr_if;
 struct sr_rt;
+struct sr_rt_cache;
+
+#define SR_RX_RING_SZ (256 * 1024)
+
+/* ----------------------------------------------------------------------------
+ * struct sr_rx_ring
+ *
+ * Bytes read from the server and not yet handled.  Messages are parsed in
+ * place between head and tail; when the next one does not fit after head,
+ * the bytes left are slid to the front before reading more.
+ *
+ * reads and msgs count recv calls that returned data and messages handled,
+ * so msgs / reads is how many messages each read brought in on average.
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_rx_ring
+{
+    uint8_t* buf;       /* SR_RX_RING_SZ bytes, allocated on first read */
+    unsigned int head;  /* first byte not yet handled */
+    unsigned int tail;  /* end of the bytes read */
+    unsigned long reads;        /* recv calls that returned data */
+    unsigned long msgs;         /* messages handled */
+    unsigned long bursts;       /* calls to sr_read_from_server */
+    unsigned int max_burst;     /* most messages handled in one call */
+};
 
 /* ----------------------------------------------------------------------------
  * struct sr_instance
@@ -44,14 +71,24 @@ struct sr_rt;
 struct sr_instance
 {
     int  sockfd;   /* socket to server */
+    struct sr_rx_ring rx; /* bytes read from sockfd */
     char user[32]; /* user name */
     char host[32]; /* host name */ 
     char template[30]; /* template name if any */
     unsigned short topo_id;
     struct sockaddr_in sr_addr; /* address to server */
     struct sr_if* if_list; /* list of interfaces */
-    struct sr_rt* routing_table; /* routing table */
+    struct sr_if_index if_index; /* interfaces by index and by name */
+    struct sr_rt* routing_table; /* routing table, owned by the live fib */
+    struct sr_fib_rcu fib_rcu; /* live lookup structure */
+    const char* rtable_file; /* reloaded on SIGHUP */
+    int fib_mode; /* SR_FIB_TRIE or SR_FIB_DIR248 */
+    struct sr_rt_cache* rt_cache; /* destination cache in front of fib */
     struct sr_arpcache cache;   /* ARP cache */
+    unsigned int arp_max_entries; /* ARP cache capacity, 0 for default */
+    struct sr_arpq_limits arp_queue_limits; /* caps on packets awaiting ARP */
+    const char* arp_snapshot; /* ARP cache saved here at exit, loaded at start */
+    volatile int stopping; /* SIGINT/SIGTERM seen, reads from sockfd end */
     pthread_attr_t attr;
     FILE* logfile;
 };
@@ -61,16 +98,19 @@ int sr_verify_routing_table(struct sr_instance* sr);
 
 /* -- sr_vns_comm.c -- */
 int sr_send_packet(struct sr_instance* , uint8_t* , unsigned int , const char*);
+int sr_send_packet_idx(struct sr_instance* , uint8_t* , unsigned int , int);
 int sr_connect_to_server(struct sr_instance* ,unsigned short , char* );
 int sr_read_from_server(struct sr_instance* );
+void sr_print_rx_stats(struct sr_instance* );
 
 /* -- sr_router.c -- */
 void sr_init(struct sr_instance* );
-void sr_handlepacket(struct sr_instance* , uint8_t * , unsigned int , char* );
-void handle_ip(struct sr_instance* sr, uint8_t * packet/* lent */,unsigned int len, char* name);
+void sr_handlepacket(struct sr_instance* , uint8_t * , unsigned int , int );
+void handle_ip(struct sr_instance* sr, uint8_t * packet/* lent */,unsigned int len, int ifindex);
 void handle_icmp(struct sr_instance* sr, uint8_t * packet, int len, struct sr_if* iface, int type, int code);
-void send_arprequest(struct sr_instance* sr, uint32_t ip, char* name);
-void send_arpreply(struct sr_instance* sr, uint8_t* packet, unsigned int len, const char* name);
+void send_arprequest(struct sr_instance* sr, uint32_t ip, int ifindex);
+void send_arprequest_to(struct sr_instance* sr, uint32_t ip, const uint8_t* dhost, int ifindex);
+void send_arpreply(struct sr_instance* sr, uint8_t* packet, unsigned int len, int ifindex);
 
 
 /* -- sr_if.c -- */
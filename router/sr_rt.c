@@ -12,6 +12,13 @@
 #include <assert.h>
 #include <string.h>
 #include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <fcntl.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 
 
 #include <sys/socket.h>
@@ -20,71 +27,394 @@
 #include <arpa/inet.h>
 
 #include "sr_rt.h"
+#include "sr_fib.h"
 #include "sr_router.h"
 
+/* large tables are only partly echoed to stdout */
+#define SR_RT_PRINT_MAX 64
+
 /*---------------------------------------------------------------------
- * Method:
+ * Method: sr_rt_parse_ip(..)
+ * Scope:  Local
+ *
+ * Parse the dotted quad in [p, end) into *ip_nbo.  Returns 0 unless the
+ * whole token is a valid a.b.c.d address.
  *
  *---------------------------------------------------------------------*/
 
-int sr_load_rt(struct sr_instance* sr,const char* filename)
+static int sr_rt_parse_ip(const char* p, const char* end, uint32_t* ip_nbo)
 {
-    FILE* fp;
-    char  line[BUFSIZ];
-    char  dest[32];
-    char  gw[32];
-    char  mask[32];
-    char  iface[32];
-    struct in_addr dest_addr;
-    struct in_addr gw_addr;
-    struct in_addr mask_addr;
-    int clear_routing_table = 0;
+    uint32_t addr = 0, octet = 0;
+    int part, digits;
 
-    /* -- REQUIRES -- */
-    assert(filename);
-    if( access(filename,R_OK) != 0)
+    for(part = 0; part < 4; part++)
     {
-        perror("access");
-        return -1;
+        if(part)
+        {
+            if(p == end || *p != '.')
+            { return 0; }
+            p++;
+        }
+
+        octet = 0;
+        for(digits = 0; p < end && *p >= '0' && *p <= '9' && digits < 3; digits++)
+        { octet = octet * 10 + (*p++ - '0'); }
+        if(digits == 0 || octet > 255)
+        { return 0; }
+
+        addr = (addr << 8) | octet;
     }
 
-    fp = fopen(filename,"r");
+    *ip_nbo = htonl(addr);
+    return p == end;
+} /* -- sr_rt_parse_ip -- */
 
-    while( fgets(line,BUFSIZ,fp) != 0)
+/*---------------------------------------------------------------------
+ * Method: sr_rt_parse_list(..)
+ * Scope:  Local
+ *
+ * Split the comma separated token [p, end) into item/item_end.
+ * Returns the number of items, or 0 if there are more than
+ * SR_FIB_MAX_PATHS or one of them is empty.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_rt_parse_list(const char* p, const char* end,
+                            const char** item, const char** item_end)
+{
+    int n = 0;
+
+    while(n < SR_FIB_MAX_PATHS)
     {
-        sscanf(line,"%s %s %s %s",dest,gw,mask,iface);
-        if(inet_aton(dest,&dest_addr) == 0)
-        { 
-            fprintf(stderr,
-                    "Error loading routing table, cannot convert %s to valid IP\n",
-                    dest);
-            return -1; 
+        item[n] = p;
+        while(p < end && *p != ',')
+        { p++; }
+        item_end[n] = p;
+        if(item[n] == item_end[n])
+        { return 0; }
+        n++;
+        if(p == end)
+        { return n; }
+        p++;
+    }
+
+    return 0;
+} /* -- sr_rt_parse_list -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_parse(..)
+ * Scope:  Local
+ *
+ * Parse rtable text in [text, end) straight into fib.  Each line
+ * becomes one trie/table route and one entry of rt per path; rt must
+ * have room for every line and every comma.  A line of the form
+ *
+ *     dest gw1,gw2,... mask iface1,iface2,...
+ *
+ * is an equal cost multipath route; a single interface may be given for
+ * all the gateways.  Blank lines are skipped.  Returns the number of
+ * routes and sets *n_rt to the number of rt entries used, or returns -1
+ * after reporting the first bad line.
+ *
+ *---------------------------------------------------------------------*/
+
+static long sr_rt_parse(struct sr_fib* fib, struct sr_fib_nh_index* index,
+                        const char* text, const char* end,
+                        struct sr_rt* rt, struct sr_fib_route* routes,
+                        long* n_rt)
+{
+    const char* p = text;
+    const char* line_end = 0;
+    const char* tok[4];
+    const char* tok_end[4];
+    const char* gw[SR_FIB_MAX_PATHS];
+    const char* gw_end[SR_FIB_MAX_PATHS];
+    const char* ifn[SR_FIB_MAX_PATHS];
+    const char* ifn_end[SR_FIB_MAX_PATHS];
+    struct sr_nexthop paths[SR_FIB_MAX_PATHS];
+    uint32_t addr[3];
+    long n = 0, r = 0, line_no = 0;
+    int i, k, n_gw, n_if;
+
+    for(; p < end; p = line_end + 1)
+    {
+        line_no++;
+        line_end = memchr(p, '\n', end - p);
+        if(line_end == 0)
+        { line_end = end; }
+
+        /* -- split into dest gw mask iface -- */
+        for(i = 0; i < 4; i++)
+        {
+            while(p < line_end && (*p == ' ' || *p == '\t' || *p == '\r'))
+            { p++; }
+            tok[i] = p;
+            while(p < line_end && *p != ' ' && *p != '\t' && *p != '\r')
+            { p++; }
+            tok_end[i] = p;
+            if(tok[i] == tok_end[i])
+            { break; }
         }
-        if(inet_aton(gw,&gw_addr) == 0)
-        { 
-            fprintf(stderr,
-                    "Error loading routing table, cannot convert %s to valid IP\n",
-                    gw);
-            return -1; 
+        if(i == 0)
+        { continue; }
+
+        n_gw = (i < 4) ? 0 : sr_rt_parse_list(tok[1], tok_end[1], gw, gw_end);
+        n_if = (i < 4) ? 0 : sr_rt_parse_list(tok[3], tok_end[3], ifn, ifn_end);
+        for(k = 0; k < n_if; k++)
+        {
+            if(ifn_end[k] - ifn[k] >= sr_IFACE_NAMELEN)
+            { n_if = 0; }
         }
-        if(inet_aton(mask,&mask_addr) == 0)
-        { 
+        if(n_gw == 0 || n_if == 0 || (n_if != 1 && n_if != n_gw))
+        {
             fprintf(stderr,
-                    "Error loading routing table, cannot convert %s to valid IP\n",
-                    mask);
-            return -1; 
+                    "Error loading routing table, malformed line %ld\n",
+                    line_no);
+            return -1;
+        }
+        for(i = 0; i < 3; i++)
+        {
+            if(i == 1)
+            { continue; }
+            if(!sr_rt_parse_ip(tok[i], tok_end[i], &addr[i]))
+            {
+                fprintf(stderr,
+                        "Error loading routing table, cannot convert %.*s to valid IP\n",
+                        (int)(tok_end[i] - tok[i]), tok[i]);
+                return -1;
+            }
         }
-        if( clear_routing_table == 0 ){
-            printf("Loading routing table from server, clear local routing table.\n");
-            sr->routing_table = 0;
-            clear_routing_table = 1;
+
+        /* -- one list entry per path -- */
+        for(k = 0; k < n_gw; k++)
+        {
+            if(!sr_rt_parse_ip(gw[k], gw_end[k], &addr[1]))
+            {
+                fprintf(stderr,
+                        "Error loading routing table, cannot convert %.*s to valid IP\n",
+                        (int)(gw_end[k] - gw[k]), gw[k]);
+                return -1;
+            }
+
+            i = (n_if == 1) ? 0 : k;
+            rt[n].dest.s_addr = addr[0];
+            rt[n].gw.s_addr   = addr[1];
+            rt[n].mask.s_addr = addr[2];
+            memset(rt[n].interface, 0, sr_IFACE_NAMELEN);
+            memcpy(rt[n].interface, ifn[i], ifn_end[i] - ifn[i]);
+            rt[n].n_paths = k ? 0 : n_gw;
+            rt[n].next = 0;
+            if(n)
+            { rt[n - 1].next = &(rt[n]); }
+
+            paths[k].gw = addr[1];
+            memcpy(paths[k].ifname, rt[n].interface, sr_IFACE_NAMELEN);
+            n++;
         }
-        sr_add_rt_entry(sr,dest_addr,gw_addr,mask_addr,iface);
-    } /* -- while -- */
+
+        routes[r].prefix = ntohl(addr[0]);
+        routes[r].plen = sr_fib_mask_len(addr[2]);
+        routes[r].nh = sr_fib_add_group(fib, index, paths, n_gw);
+        r++;
+    }
+
+    *n_rt = n;
+    return r;
+} /* -- sr_rt_parse -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_load_rt_image(..)
+ * Scope:  Local
+ *
+ * Map a FIB image written by sr_fib_write_image() and swap it in.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_load_rt_image(struct sr_instance* sr, const char* filename,
+                            const struct timeval* start)
+{
+    struct sr_fib* fib = 0;
+    struct timeval done;
+    uint32_t n_routes = 0, n_nexthops = 0;
+
+    if((fib = sr_fib_map_image(sr, filename)) == 0)
+    { return -1; }
+    n_routes = fib->n_routes;
+    n_nexthops = fib->n_nexthops;
+
+    sr_fib_publish(sr, fib);
+
+    gettimeofday(&done, 0);
+    printf("Mapped %u routes (%u next hops) from image %s in %.1f ms\n",
+           n_routes, n_nexthops, filename,
+           (done.tv_sec - start->tv_sec) * 1000.0 +
+           (done.tv_usec - start->tv_usec) / 1000.0);
+
+    return 0;
+} /* -- sr_load_rt_image -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_load_rt(..)
+ * Scope:  Global
+ *
+ * Read a routing table file into a new list and FIB and swap them in
+ * for the current ones.  The file is mapped and parsed in one pass with
+ * the list entries carved out of a single allocation, so large tables
+ * load in time linear in their size.  A file starting with the FIB
+ * image magic is mapped instead of parsed.  Forwarding keeps using the
+ * old table until the new one is published.  On error the current table
+ * is left alone.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_load_rt(struct sr_instance* sr,const char* filename)
+{
+    struct sr_fib* fib = 0;
+    struct sr_fib_nh_index index;
+    struct sr_fib_route* routes = 0;
+    struct sr_rt* rt = 0;
+    struct timeval start, done;
+    struct stat st;
+    const char* text = 0;
+    const char* p = 0;
+    long lines = 1, commas = 0, n = 0, n_rt = 0;
+    uint32_t n_nexthops = 0;
+    int fd;
+
+    /* -- REQUIRES -- */
+    assert(filename);
+    gettimeofday(&start, 0);
+
+    if((fd = open(filename, O_RDONLY)) < 0 || fstat(fd, &st) != 0)
+    {
+        perror("open");
+        if(fd >= 0)
+        { close(fd); }
+        return -1;
+    }
+
+    if(st.st_size > 0)
+    {
+        text = (const char*)mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(text == (const char*)MAP_FAILED)
+        {
+            perror("mmap");
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+
+    /* -- precompiled images are mapped as they are, no parsing -- */
+    if(text && st.st_size >= (off_t)strlen(SR_FIB_IMAGE_MAGIC) &&
+       memcmp(text, SR_FIB_IMAGE_MAGIC, strlen(SR_FIB_IMAGE_MAGIC)) == 0)
+    {
+        munmap((void*)text, st.st_size);
+        return sr_load_rt_image(sr, filename, &start);
+    }
+
+    /* -- one route per line and one list entry per path at most -- */
+    for(p = text; p && (p = memchr(p, '\n', text + st.st_size - p)); p++)
+    { lines++; }
+    for(p = text; p && (p = memchr(p, ',', text + st.st_size - p)); p++)
+    { commas++; }
+
+    rt = (struct sr_rt*)malloc((lines + commas) * sizeof(struct sr_rt));
+    routes = (struct sr_fib_route*)malloc(lines * sizeof(struct sr_fib_route));
+    assert(rt && routes);
+
+    fib = sr_fib_alloc(sr->fib_mode, &index);
+    n = text ? sr_rt_parse(fib, &index, text, text + st.st_size, rt, routes,
+                            &n_rt) : 0;
+
+    if(text)
+    { munmap((void*)text, st.st_size); }
+    free(index.slots);
+
+    if(n < 0)
+    {
+        free(routes);
+        free(rt);
+        sr_fib_destroy(fib);
+        return -1;
+    }
+
+    sr_fib_build_routes(sr, fib, routes, n);
+    n_nexthops = fib->n_nexthops;
+    free(routes);
+    fib->routing_table = n ? rt : 0;
+    fib->rt_block = 1;
+    if(n == 0)
+    { free(rt); }
+
+    if(n)
+    { printf("Loading routing table from server, clear local routing table.\n"); }
+
+    /* -- built off to the side, now swap in -- */
+    sr_fib_publish(sr, fib);
+
+    gettimeofday(&done, 0);
+    printf("Loaded %ld routes (%u next hops) from %s in %.1f ms\n",
+           n, n_nexthops, filename,
+           (done.tv_sec - start.tv_sec) * 1000.0 +
+           (done.tv_usec - start.tv_usec) / 1000.0);
 
     return 0; /* -- success -- */
 } /* -- sr_load_rt -- */
 
+/*---------------------------------------------------------------------
+ * Method: sr_free_rt_list(..)
+ * Scope:  Global
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_free_rt_list(struct sr_rt* rt)
+{
+    struct sr_rt* next = 0;
+
+    while(rt)
+    {
+        next = rt->next;
+        free(rt);
+        rt = next;
+    }
+} /* -- sr_free_rt_list -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_reloader(..)
+ * Scope:  Global
+ *
+ * Thread that reloads sr->rtable_file whenever the process gets a
+ * SIGHUP.  SIGHUP must be blocked in every thread for this to see it.
+ *
+ *---------------------------------------------------------------------*/
+
+void* sr_rt_reloader(void* sr_ptr)
+{
+    struct sr_instance* sr = (struct sr_instance*)sr_ptr;
+    sigset_t set;
+    int sig = 0;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+
+    while(1)
+    {
+        if(sigwait(&set, &sig) != 0 || sr->rtable_file == 0)
+        { continue; }
+
+        if(sr_load_rt(sr, sr->rtable_file) != 0)
+        {
+            fprintf(stderr,"Error reloading routing table from file %s\n",
+                    sr->rtable_file);
+            continue;
+        }
+        printf("Reloaded routing table from %s\n", sr->rtable_file);
+    }
+
+    return 0;
+} /* -- sr_rt_reloader -- */
+
 /*---------------------------------------------------------------------
  * Method:
  *
@@ -109,6 +439,7 @@ struct in_addr gw, struct in_addr mask,char* if_name)
         sr->routing_table->gw   = gw;
         sr->routing_table->mask = mask;
         strncpy(sr->routing_table->interface,if_name,sr_IFACE_NAMELEN);
+        sr->routing_table->n_paths = 1;
 
         return;
     }
@@ -128,6 +459,7 @@ struct in_addr gw, struct in_addr mask,char* if_name)
     rt_walker->gw   = gw;
     rt_walker->mask = mask;
     strncpy(rt_walker->interface,if_name,sr_IFACE_NAMELEN);
+    rt_walker->n_paths = 1;
 
 } /* -- sr_add_entry -- */
 
@@ -139,9 +471,16 @@ struct in_addr gw, struct in_addr mask,char* if_name)
 void sr_print_routing_table(struct sr_instance* sr)
 {
     struct sr_rt* rt_walker = 0;
+    int printed = 0;
 
     if(sr->routing_table == 0)
     {
+        if(sr_fib_current(&(sr->fib_rcu)) && sr_fib_current(&(sr->fib_rcu))->image)
+        {
+            printf("Routes served from FIB image (%u routes, no listing)\n",
+                   sr_fib_current(&(sr->fib_rcu))->n_routes);
+            return;
+        }
         printf(" *warning* Routing table empty \n");
         return;
     }
@@ -154,6 +493,11 @@ void sr_print_routing_table(struct sr_instance* sr)
     while(rt_walker->next)
     {
         rt_walker = rt_walker->next; 
+        if(++printed == SR_RT_PRINT_MAX)
+        {
+            printf("... (table truncated)\n");
+            break;
+        }
         sr_print_routing_entry(rt_walker);
     }
 
@@ -179,44 +523,142 @@ void sr_print_routing_entry(struct sr_rt* entry)
 
 } /* -- sr_print_routing_entry -- */
 
+/*---------------------------------------------------------------------
+ * Method: sr_longest_prefix_nexthop(..)
+ * Scope:  Global
+ *
+ * Return the next hop (gateway, interface and source MAC) of the
+ * longest prefix route matching ip (network byte order), or 0 if there
+ * is no matching route.  The record belongs to the FIB; do not free it,
+ * and only use it inside the sr_fib_read_lock() section it came from.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_nexthop* sr_longest_prefix_nexthop(struct sr_instance* sr, uint32_t ip)
+{
+    return sr_fib_lookup(sr_fib_current(&(sr->fib_rcu)), ip);
+} /* -- sr_longest_prefix_nexthop -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_longest_prefix_nexthops(..)
+ * Scope:  Global
+ *
+ * sr_longest_prefix_nexthop() for a burst of n destinations (network
+ * byte order) at once, nhs[i] receiving the result for ips[i].  Faster
+ * than n single lookups on tables too big for the cache, since the
+ * lookups' memory accesses are overlapped.  Same rules for using the
+ * results as sr_longest_prefix_nexthop().
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_longest_prefix_nexthops(struct sr_instance* sr, const uint32_t* ips,
+                                struct sr_nexthop** nhs, int n)
+{
+    if(n > 0)
+    { sr_fib_lookup_burst(sr_fib_current(&(sr->fib_rcu)), ips, nhs, n); }
+} /* -- sr_longest_prefix_nexthops -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_longest_prefix_iface(..)
+ * Scope:  Global
+ *
+ * Copy the interface of the longest prefix route matching ip (network
+ * byte order) into iface.  iface is left untouched if nothing matches.
+ *
+ *---------------------------------------------------------------------*/
+
 void sr_longest_prefix_iface(struct sr_instance* sr, uint32_t ip, char* iface){
-    struct sr_rt* rt_walker = 0;
-    /*char iface[sr_IFACE_NAMELEN];*/
-    uint32_t diff=0, subnet = 0, x=0;
-    
-    if(sr->routing_table == 0)
+    struct sr_nexthop* nh = 0;
+
+    if(sr_fib_current(&(sr->fib_rcu)) == 0 ||
+       sr_fib_current(&(sr->fib_rcu))->n_routes == 0)
     {
         printf(" *warning* Routing table empty \n");
         return ;
     }
 
-    rt_walker = sr->routing_table;
-    subnet = ntohl(rt_walker->dest.s_addr & rt_walker->mask.s_addr);
-    diff = ntohl(ip & rt_walker->mask.s_addr);
-    /*printf("diff : %lu\n", diff);
-    printf("subnet: %lu\n", subnet);
-    /*comment to self : lowest diff of integer subtraction between ip's will give you longest prefix*/
-    /*
-    printf("Destination Address: %lu\n", ntohl(rt_walker->dest.s_addr));
-    printf("Looking for: %lu\n", ip);
-    printf("Looking for: %lu\n", ntohl(ip));
-    printf("Destination Address: %lu\n", diff);*/
-
-    if(diff == subnet){
-        memcpy(iface, rt_walker->interface, sr_IFACE_NAMELEN);
-    }
-    while(rt_walker->next)
+    nh = sr_longest_prefix_nexthop(sr, ip);
+    if(nh)
     {
-        rt_walker = rt_walker->next; 
-        subnet = ntohl(rt_walker->dest.s_addr & rt_walker->mask.s_addr);
-        diff = ntohl(ip & rt_walker->mask.s_addr);
-        if(diff == subnet){
-            /*printf("%d\n", diff);*/
-            
-            memcpy(iface, rt_walker->interface, sr_IFACE_NAMELEN);
-        }
-        
+        memcpy(iface, nh->ifname, sr_IFACE_NAMELEN);
     }
-    /*printf("OUTGOING INTEERFACE: %s\n", iface);*/
-    return;
 }
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_cache_nexthop(..)
+ * Scope:  Global
+ *
+ * Same as sr_longest_prefix_nexthop() but consults the destination
+ * cache first and fills it on a miss.  Safe to call from the packet
+ * thread and the ARP sweep thread at the same time.  As with any FIB
+ * lookup the caller must be inside a sr_fib_read_lock() section.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_nexthop* sr_rt_cache_nexthop(struct sr_instance* sr, uint32_t ip)
+{
+    struct sr_rt_cache* cache = sr->rt_cache;
+    struct sr_rt_cache_entry* entry = 0;
+    struct sr_fib* fib = sr_fib_current(&(sr->fib_rcu));
+    struct sr_nexthop* nh = 0;
+    uint32_t seq = 0, generation = 0;
+
+    if(cache == 0 || fib == 0)
+    { return sr_fib_lookup(fib, ip); }
+
+    generation = fib->generation;
+    entry = &(cache->entries[(ntohl(ip) * 2654435761u) >> (32 - SR_RT_CACHE_BITS)]);
+
+    /* -- read side: a stable, even sequence number brackets the copy -- */
+    seq = entry->seq;
+    if((seq & 1) == 0)
+    {
+        __sync_synchronize();
+        if(entry->dst == ip && entry->generation == generation)
+        { nh = entry->nh; }
+        __sync_synchronize();
+        if(entry->seq != seq)
+        { nh = 0; }
+    }
+
+    if(nh)
+    {
+        __sync_fetch_and_add(&(cache->hits), 1);
+        return nh;
+    }
+    __sync_fetch_and_add(&(cache->misses), 1);
+
+    nh = sr_fib_lookup(fib, ip);
+    if(nh == 0)
+    { return 0; }
+
+    /* -- write side: skip the fill if another thread holds the slot -- */
+    seq = entry->seq;
+    if((seq & 1) == 0 && __sync_bool_compare_and_swap(&(entry->seq), seq, seq + 1))
+    {
+        entry->dst = ip;
+        entry->generation = generation;
+        entry->nh = nh;
+        __sync_synchronize();
+        entry->seq = seq + 2;
+    }
+
+    return nh;
+} /* -- sr_rt_cache_nexthop -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_print_rt_cache_stats(..)
+ * Scope:  Global
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_print_rt_cache_stats(struct sr_instance* sr)
+{
+    struct sr_rt_cache* cache = sr->rt_cache;
+
+    if(cache == 0)
+    { return; }
+
+    printf("Route cache: %d slots, %lu hits, %lu misses\n",
+           SR_RT_CACHE_SZ, cache->hits, cache->misses);
+} /* -- sr_print_rt_cache_stats -- */
@@ -20,11 +20,16 @@
 
 #include "sr_if.h"
 
+struct sr_nexthop;
+
 /* ----------------------------------------------------------------------------
  * struct sr_rt
  *
  * Node in the routing table 
  *
+ * An ECMP route is stored as one node per path.  The first has n_paths
+ * set to the number of paths, the nodes following it have n_paths 0.
+ *
  * -------------------------------------------------------------------------- */
 
 struct sr_rt
@@ -33,16 +38,54 @@ struct sr_rt
     struct in_addr gw;
     struct in_addr mask;
     char   interface[sr_IFACE_NAMELEN];
+    int    n_paths;
     struct sr_rt* next;
 };
 
 
+/* ----------------------------------------------------------------------------
+ * struct sr_rt_cache
+ *
+ * Direct mapped destination -> next hop cache in front of the FIB.  An
+ * entry is only valid for the FIB generation it was filled from, so
+ * loading a new routing table invalidates the whole cache.  Both the
+ * packet thread and the ARP sweep thread use it, so each slot carries a
+ * sequence number: odd while a writer is filling it, readers retry as a
+ * miss if it changed under them.
+ *
+ * -------------------------------------------------------------------------- */
+
+#define SR_RT_CACHE_BITS 10
+#define SR_RT_CACHE_SZ   (1 << SR_RT_CACHE_BITS)
+
+struct sr_rt_cache_entry
+{
+    volatile uint32_t seq;
+    uint32_t dst;                       /* nbo */
+    uint32_t generation;
+    struct sr_nexthop* nh;
+};
+
+struct sr_rt_cache
+{
+    struct sr_rt_cache_entry entries[SR_RT_CACHE_SZ];
+    unsigned long hits;
+    unsigned long misses;
+};
+
 int sr_load_rt(struct sr_instance*,const char*);
+void sr_free_rt_list(struct sr_rt* rt);
+void* sr_rt_reloader(void* sr_ptr);
 void sr_add_rt_entry(struct sr_instance*, struct in_addr,struct in_addr,
                   struct in_addr, char*);
 void sr_print_routing_table(struct sr_instance* sr);
 void sr_print_routing_entry(struct sr_rt* entry);
 void sr_longest_prefix_iface(struct sr_instance* sr, uint32_t ip, char* iface);
+struct sr_nexthop* sr_longest_prefix_nexthop(struct sr_instance* sr, uint32_t ip);
+void sr_longest_prefix_nexthops(struct sr_instance* sr, const uint32_t* ips,
+                                struct sr_nexthop** nhs, int n);
+struct sr_nexthop* sr_rt_cache_nexthop(struct sr_instance* sr, uint32_t ip);
+void sr_print_rt_cache_stats(struct sr_instance* sr);
 
 
 #endif  /* --  sr_RT_H -- */
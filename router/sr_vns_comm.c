@@ -40,6 +40,7 @@
 #include "sr_router.h"
 #include "sr_if.h"
 #include "sr_protocol.h"
+#include "sr_fib.h"
 
 #include "sha1.h"
 #include "vnscommand.h"
@@ -48,7 +49,7 @@ static void sr_log_packet(struct sr_instance* , uint8_t* , int );
 static int  sr_arp_req_not_for_us(struct sr_instance* sr,
                                   uint8_t * packet /* lent */,
                                   unsigned int len,
-                                  char* interface  /* lent */);
+                                  int ifindex);
 int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expected_cmd);
 
 /*-----------------------------------------------------------------------------
@@ -177,6 +178,7 @@ int sr_handle_hwinfo(struct sr_instance* sr, c_hwinfo* hwinfo)
 {
     int num_entries;
     int i = 0;
+    int slot;
 
     /* REQUIRES */
     assert(sr);
@@ -229,6 +231,11 @@ int sr_handle_hwinfo(struct sr_instance* sr, c_hwinfo* hwinfo)
     printf("Router interfaces:\n");
     sr_print_if_list(sr);
 
+    /* -- routes loaded before we knew our interfaces can bind now -- */
+    slot = sr_fib_read_lock(&(sr->fib_rcu));
+    sr_fib_bind(sr, sr_fib_current(&(sr->fib_rcu)));
+    sr_fib_read_unlock(&(sr->fib_rcu), slot);
+
     return num_entries;
 } /* -- sr_handle_hwinfo -- */
 
@@ -318,25 +325,162 @@ int sr_handle_auth_status(struct sr_instance* sr, c_auth_status* status) {
     return status->auth_ok;
 }
 
+/*-----------------------------------------------------------------------------
+ * Method: sr_rx_ready(..)
+ * Scope: Local
+ *
+ * Return 1 if a whole message is buffered.  If not, take whatever the
+ * socket has ready without blocking and check again.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_rx_ready(struct sr_instance* sr)
+{
+    struct sr_rx_ring* rx = &(sr->rx);
+    uint32_t len = 0;
+    int ret;
+
+    if(rx->tail - rx->head >= 4)
+    {
+        memcpy(&len, rx->buf + rx->head, 4);
+        len = ntohl(len);
+        if(rx->tail - rx->head >= len)
+        { return 1; }
+    }
+
+    /* -- only a partial message is left, slide it down to make room -- */
+    if(rx->head)
+    {
+        memmove(rx->buf, rx->buf + rx->head, rx->tail - rx->head);
+        rx->tail -= rx->head;
+        rx->head = 0;
+    }
+
+    /* -- EOF and errors are left for the next blocking read to report -- */
+    if((ret = recv(sr->sockfd, rx->buf + rx->tail,
+                    SR_RX_RING_SZ - rx->tail, MSG_DONTWAIT)) <= 0)
+    { return 0; }
+
+    rx->tail += ret;
+    rx->reads++;
+
+    if(rx->tail < 4)
+    { return 0; }
+    memcpy(&len, rx->buf, 4);
+    return rx->tail >= ntohl(len);
+} /* -- sr_rx_ready -- */
+
 /*-----------------------------------------------------------------------------
  * Method: sr_read_from_server(..)
  * Scope: global
  *
  * Houses main while loop for communicating with the virtual router server.
  *
+ * Blocks for one message, then keeps handling messages for as long as
+ * whole ones are buffered or arrive without blocking, so a busy link is
+ * drained with one recv per ring full rather than one per packet.
+ *
  *---------------------------------------------------------------------------*/
 
 int sr_read_from_server(struct sr_instance* sr /* borrowed */)
 {
-    return sr_read_from_server_expect(sr, 0);
-}
+    unsigned int burst = 0;
+    int ret;
+
+    do
+    {
+        if((ret = sr_read_from_server_expect(sr, 0)) != 1)
+        { return ret; }
+        burst++;
+    } while(sr_rx_ready(sr));
+
+    sr->rx.bursts++;
+    if(burst > sr->rx.max_burst)
+    { sr->rx.max_burst = burst; }
+
+    return 1;
+} /* -- sr_read_from_server -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_print_rx_stats(..)
+ * Scope: global
+ *
+ * Print how well reads from the server are being batched.
+ *
+ *---------------------------------------------------------------------------*/
+
+void sr_print_rx_stats(struct sr_instance* sr)
+{
+    struct sr_rx_ring* rx = &(sr->rx);
+
+    printf("VNS reads: %lu messages in %lu reads (%.2f per read), "
+           "%lu bursts, largest %u\n",
+           rx->msgs, rx->reads,
+           rx->reads ? (double)rx->msgs / rx->reads : 0.0,
+           rx->bursts, rx->max_burst);
+} /* -- sr_print_rx_stats -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_rx_fill(..)
+ * Scope: Local
+ *
+ * Make sure at least want bytes are buffered from sr->rx.head on, reading
+ * as much as the socket has ready each time rather than just what is
+ * needed.  Returns 0, or -1 if the connection failed or was closed.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_rx_fill(struct sr_instance* sr, unsigned int want)
+{
+    struct sr_rx_ring* rx = &(sr->rx);
+    int ret = 0;
+
+    if(!rx->buf && (rx->buf = (uint8_t*)malloc(SR_RX_RING_SZ)) == 0)
+    {
+        fprintf(stderr,"Error: out of memory (sr_read_from_server)\n");
+        return -1;
+    }
+
+    while(rx->tail - rx->head < want)
+    {
+        /* -- no room for the whole message after head, slide it down -- */
+        if(rx->head + want > SR_RX_RING_SZ)
+        {
+            memmove(rx->buf, rx->buf + rx->head, rx->tail - rx->head);
+            rx->tail -= rx->head;
+            rx->head = 0;
+        }
+
+        if((ret = recv(sr->sockfd, rx->buf + rx->tail,
+                        SR_RX_RING_SZ - rx->tail, 0)) == -1)
+        {
+            /* -- just in case SIGALRM breaks recv -- */
+            if ( errno == EINTR )
+            { continue; }
+
+            perror("recv(..):sr_client.c::sr_read_from_server");
+            return -1;
+        }
+        if(ret == 0)
+        {
+            if(!sr->stopping)
+            { fprintf(stderr,"Error: server closed the connection\n"); }
+            return -1;
+        }
+        rx->tail += ret;
+        rx->reads++;
+    }
+
+    return 0;
+} /* -- sr_rx_fill -- */
 
 int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expected_cmd)
 {
     int command, len;
+    int ifindex;
     unsigned char *buf = 0;
     c_packet_ethernet_header* sr_pkt = 0;
-    int ret = 0, bytes_read = 0;
+    int ret = 0;
 
     /* REQUIRES */
     assert(sr);
@@ -345,66 +489,35 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
       Read a command from the server
       -------------------------------------------------------------------------*/
 
-    bytes_read = 0;
-
     /* attempt to read the size of the incoming packet */
-    while( bytes_read < 4)
-    {
-        do
-        { /* -- just in case SIGALRM breaks recv -- */
-            errno = 0; /* -- hacky glibc workaround -- */
-            if((ret = recv(sr->sockfd,((uint8_t*)&len) + bytes_read,
-                            4 - bytes_read, 0)) == -1)
-            {
-                if ( errno == EINTR )
-                { continue; }
-
-                perror("recv(..):sr_client.c::sr_read_from_server");
-                return -1;
-            }
-            bytes_read += ret;
-        } while ( errno == EINTR); /* be mindful of signals */
-
-    }
+    if(sr_rx_fill(sr, 4) != 0)
+    { return -1; }
 
+    memcpy(&len, sr->rx.buf + sr->rx.head, 4);
     len = ntohl(len);
 
-    if ( len > 10000 || len < 0 )
+    if ( len > 10000 || len < (int)sizeof(c_base) )
     {
         fprintf(stderr,"Error: command length to large %d\n",len);
         close(sr->sockfd);
         return -1;
     }
 
-    if((buf = malloc(len)) == 0)
+    /* read the rest of the command */
+    if(sr_rx_fill(sr, len) != 0)
     {
-        fprintf(stderr,"Error: out of memory (sr_read_from_server)\n");
+        fprintf(stderr,"Error: failed reading command body\n");
+        close(sr->sockfd);
         return -1;
     }
 
-    /* set first field of command since we've already read it */
-    *((int *)buf) = htonl(len);
-
-    bytes_read = 0;
-
-    /* read the rest of the command */
-    while ( bytes_read < len - 4)
-    {
-        do
-        {/* -- just in case SIGALRM breaks recv -- */
-            errno = 0; /* -- hacky glibc workaround -- */
-            if ((ret = read(sr->sockfd, buf+4+bytes_read, len - 4 - bytes_read)) ==
-                    -1)
-            {
-                if ( errno == EINTR )
-                { continue; }
-                fprintf(stderr,"Error: failed reading command body %d\n",ret);
-                close(sr->sockfd);
-                return -1;
-            }
-            bytes_read += ret;
-        } while (errno == EINTR); /* be mindful of signals */
-    }
+    /* the command is handled in place.  Its bytes are only reused by the
+       next read, so it stays valid until we return */
+    buf = sr->rx.buf + sr->rx.head;
+    sr->rx.head += len;
+    if(sr->rx.head == sr->rx.tail)
+    { sr->rx.head = sr->rx.tail = 0; }
+    sr->rx.msgs++;
 
     /* My entry for most unreadable line of code - guido */
     /* ... you win - mc                                  */
@@ -426,13 +539,30 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
         case VNSPACKET:
             sr_pkt = (c_packet_ethernet_header *)buf;
 
+            /* -- the server names interfaces, we use indices from here on -- */
+            ifindex = sr_get_ifindex(sr, (char*)(buf + sizeof(c_base)));
+            if ( ifindex == SR_IF_NONE )
+            {
+                fprintf(stderr, "** Error, packet on unknown interface %.16s\n",
+                        (char*)(buf + sizeof(c_base)));
+                break;
+            }
+
+            sr->if_index.stats[ifindex].rx_packets++;
+            sr->if_index.stats[ifindex].rx_bytes += len -
+                    sizeof(c_packet_ethernet_header) +
+                    sizeof(struct sr_ethernet_hdr);
+
             /* -- check if it is an ARP to another router if so drop   -- */
             if ( sr_arp_req_not_for_us(sr,
                     (buf+sizeof(c_packet_header)),
                     len - sizeof(c_packet_ethernet_header) +
                     sizeof(struct sr_ethernet_hdr),
-                    (char*)(buf + sizeof(c_base))) )
-            { break; }
+                    ifindex) )
+            {
+                sr->if_index.stats[ifindex].rx_drops++;
+                break;
+            }
 
             /* -- log packet -- */
             sr_log_packet(sr, buf + sizeof(c_packet_header),
@@ -443,7 +573,7 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
                     (buf+sizeof(c_packet_header)),
                     len - sizeof(c_packet_ethernet_header) +
                     sizeof(struct sr_ethernet_hdr),
-                    (char*)(buf + sizeof(c_base)));
+                    ifindex);
 
             break;
 
@@ -454,8 +584,6 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
             fprintf(stderr,"Reason: %s\n",((c_close*)buf)->mErrorMessage);
             sr_session_closed_help();
 
-            if(buf)
-            { free(buf); }
             return 0;
             break;
 
@@ -474,6 +602,13 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
                 fprintf(stderr,"Routing table not consistent with hardware\n");
                 return -1;
             }
+            /* -- saved ARP entries name interfaces, so restore them now -- */
+            if(sr->arp_snapshot)
+            {
+                unsigned int n = sr_arpcache_load(sr, sr->arp_snapshot);
+                if(n)
+                { printf("Restored %u ARP entries from %s\n", n, sr->arp_snapshot); }
+            }
             printf(" <-- Ready to process packets --> \n");
             break;
 
@@ -501,8 +636,6 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
 
     }/* -- switch -- */
 
-    if(buf)
-    { free(buf); }
     return ret;
 }/* -- sr_read_from_server -- */
 
@@ -517,23 +650,16 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
 static int
 sr_ether_addrs_match_interface( struct sr_instance* sr, /* borrowed */
                                 uint8_t* buf, /* borrowed */
-                                const char* name /* borrowed */ )
+                                struct sr_if* iface /* borrowed */ )
 {
     struct sr_ethernet_hdr* ether_hdr = 0;
-    struct sr_if* iface = 0;
 
     /* -- REQUIRES -- */
     assert(sr);
     assert(buf);
-    assert(name);
+    assert(iface);
 
     ether_hdr = (struct sr_ethernet_hdr*)buf;
-    iface = sr_get_interface(sr, name);
-
-    if ( iface == 0 ){
-        fprintf( stderr, "** Error, interface %s, does not exist\n", name);
-        return 0;
-    }
 
     if ( memcmp( ether_hdr->ether_shost, iface->addr, ETHER_ADDR_LEN) != 0 ){
         fprintf( stderr, "** Error, source address does not match interface\n");
@@ -563,14 +689,45 @@ int sr_send_packet(struct sr_instance* sr /* borrowed */,
                          uint8_t* buf /* borrowed */ ,
                          unsigned int len,
                          const char* iface /* borrowed */)
+{
+    int ifindex;
+
+    /* REQUIRES */
+    assert(iface);
+
+    if ( (ifindex = sr_get_ifindex(sr, iface)) == SR_IF_NONE ){
+        fprintf( stderr, "** Error, interface %s, does not exist\n", iface);
+        return -1;
+    }
+
+    return sr_send_packet_idx(sr, buf, len, ifindex);
+} /* -- sr_send_packet -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_send_packet_idx(..)
+ * Scope: Global
+ *
+ * sr_send_packet() for the interface with the given index.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_send_packet_idx(struct sr_instance* sr /* borrowed */,
+                         uint8_t* buf /* borrowed */ ,
+                         unsigned int len,
+                         int ifindex)
 {
     c_packet_header *sr_pkt;
     unsigned int total_len =  len + (sizeof(c_packet_header));
+    struct sr_if* iface = 0;
 
     /* REQUIRES */
     assert(sr);
     assert(buf);
-    assert(iface);
+
+    if ( (iface = sr_get_interface_idx(sr, ifindex)) == 0 ){
+        fprintf( stderr, "** Error, interface %d, does not exist\n", ifindex);
+        return -1;
+    }
 
     /* don't waste my time ... */
     if ( len < sizeof(struct sr_ethernet_hdr) ){
@@ -584,7 +741,7 @@ int sr_send_packet(struct sr_instance* sr /* borrowed */,
     assert(sr_pkt);
     sr_pkt->mLen  = htonl(total_len);
     sr_pkt->mType = htonl(VNSPACKET);
-    strncpy(sr_pkt->mInterfaceName,iface,16);
+    strncpy(sr_pkt->mInterfaceName,iface->name,16);
     memcpy(((uint8_t*)sr_pkt) + sizeof(c_packet_header),
             buf,len);
 
@@ -593,20 +750,24 @@ int sr_send_packet(struct sr_instance* sr /* borrowed */,
 
     if ( ! sr_ether_addrs_match_interface( sr, buf, iface) ){
         fprintf( stderr, "*** Error: problem with ethernet header, check log\n");
+        __sync_fetch_and_add(&(sr->if_index.stats[ifindex].tx_drops), 1);
         free ( sr_pkt );
         return -1;
     }
 
     if( write(sr->sockfd, sr_pkt, total_len) < total_len ){
         fprintf(stderr, "Error writing packet\n");
+        __sync_fetch_and_add(&(sr->if_index.stats[ifindex].tx_drops), 1);
         free(sr_pkt);
         return -1;
     }
 
+    __sync_fetch_and_add(&(sr->if_index.stats[ifindex].tx_packets), 1);
+    __sync_fetch_and_add(&(sr->if_index.stats[ifindex].tx_bytes), len);
     free(sr_pkt);
 
     return 0;
-} /* -- sr_send_packet -- */
+} /* -- sr_send_packet_idx -- */
 
 /*-----------------------------------------------------------------------------
  * Method: sr_log_packet()
@@ -644,23 +805,23 @@ void sr_log_packet(struct sr_instance* sr, uint8_t* buf, int len )
 int  sr_arp_req_not_for_us(struct sr_instance* sr,
                            uint8_t * packet /* lent */,
                            unsigned int len,
-                           char* interface  /* lent */)
+                           int ifindex)
 {
-    struct sr_if* iface = sr_get_interface(sr, interface);
     struct sr_ethernet_hdr* e_hdr = 0;
     struct sr_arp_hdr*       a_hdr = 0;
 
     if (len < sizeof(struct sr_ethernet_hdr) + sizeof(struct sr_arp_hdr) )
     { return 0; }
 
-    assert(iface);
-
     e_hdr = (struct sr_ethernet_hdr*)packet;
     a_hdr = (struct sr_arp_hdr*)(packet + sizeof(struct sr_ethernet_hdr));
 
+    /* -- only answer for addresses owned by the receiving interface,
+          but let gratuitous requests through so the cache can learn -- */
     if ( (e_hdr->ether_type == htons(ethertype_arp)) &&
             (a_hdr->ar_op      == htons(arp_op_request))   &&
-            (a_hdr->ar_tip     != iface->ip ) )
+            (a_hdr->ar_sip     != a_hdr->ar_tip)   &&
+            (sr_get_ifindex_byip(sr, a_hdr->ar_tip) != ifindex ) )
     { return 1; }
 
     return 0;